@@ -34,7 +34,26 @@ Application::Application(AppConfig config, bool gl) {
     config.pathtracer_direct_hemisphere_sample,
     config.pathtracer_filename,
     config.pathtracer_lensRadius,
-    config.pathtracer_focalDistance
+    config.pathtracer_focalDistance,
+    config.pathtracer_envmap_path,
+    config.pathtracer_envmap_debug,
+    config.pathtracer_sample_generator,
+    config.pathtracer_seed,
+    config.pathtracer_max_render_time,
+    config.pathtracer_progressive,
+    config.pathtracer_snapshot_interval,
+    config.pathtracer_adjoint_rr,
+    config.pathtracer_guiding,
+    config.pathtracer_integrator,
+    config.pathtracer_primary_hit_pattern,
+    config.pathtracer_denoise,
+    config.pathtracer_aovs,
+    config.pathtracer_irradiance_cache,
+    config.pathtracer_medium,
+    config.pathtracer_medium_bricks,
+    config.pathtracer_ratio_tracking,
+    config.pathtracer_homogeneous_medium,
+    config.pathtracer_noise_cache
   );
   filename = config.pathtracer_filename;
 }
@@ -52,6 +52,26 @@ struct AppConfig {
 
     pathtracer_num_threads = 1;
     pathtracer_envmap = NULL;
+    pathtracer_envmap_path = "";
+    pathtracer_envmap_debug = false;
+
+    pathtracer_sample_generator = "sobol";
+    pathtracer_seed = 0;
+    pathtracer_max_render_time = 0;
+    pathtracer_progressive = false;
+    pathtracer_snapshot_interval = 0;
+    pathtracer_adjoint_rr = false;
+    pathtracer_guiding = false;
+    pathtracer_integrator = "volpath";
+    pathtracer_primary_hit_pattern = 0;
+    pathtracer_denoise = false;
+    pathtracer_aovs = "";
+    pathtracer_irradiance_cache = false;
+    pathtracer_medium = "";
+    pathtracer_medium_bricks = false;
+    pathtracer_ratio_tracking = false;
+    pathtracer_homogeneous_medium = "";
+    pathtracer_noise_cache = 16;
 
     pathtracer_samples_per_patch = 32;
     pathtracer_max_tolerance = 0.05f;
@@ -73,6 +93,26 @@ struct AppConfig {
 
   size_t pathtracer_num_threads;
   HDRImageBuffer* pathtracer_envmap;
+  string pathtracer_envmap_path;
+  bool pathtracer_envmap_debug;
+
+  string pathtracer_sample_generator;
+  size_t pathtracer_seed;
+  double pathtracer_max_render_time;
+  bool pathtracer_progressive;
+  double pathtracer_snapshot_interval;
+  bool pathtracer_adjoint_rr;
+  bool pathtracer_guiding;
+  string pathtracer_integrator;
+  size_t pathtracer_primary_hit_pattern;
+  bool pathtracer_denoise;
+  string pathtracer_aovs;
+  bool pathtracer_irradiance_cache;
+  string pathtracer_medium;
+  bool pathtracer_medium_bricks;
+  bool pathtracer_ratio_tracking;
+  string pathtracer_homogeneous_medium;
+  size_t pathtracer_noise_cache;
 
   float pathtracer_max_tolerance;
   size_t pathtracer_samples_per_patch;
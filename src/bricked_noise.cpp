@@ -0,0 +1,235 @@
+#include "bricked_noise.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "random_util.h"
+
+namespace CGL {
+
+namespace {
+
+// Offset making brick coordinates within 2^20 of the origin nonnegative,
+// and the mask of their 21 bits in a key.
+const int64_t kKeyOffset = int64_t(1) << 20;
+const uint64_t kKeyMask = (uint64_t(1) << 21) - 1;
+
+inline int64_t floor_div(int64_t a, int64_t b) {
+  return a >= 0 ? a / b : - ((- a + b - 1) / b);
+}
+
+inline double fade(double t) {
+  return t * t * t * (t * (t * 6. - 15.) + 10.);
+}
+
+inline double lerp(double t, double a, double b) {
+  return a + t * (b - a);
+}
+
+// Dot product of (x, y, z) with one of the 12 edge directions of a cube,
+// picked by the low 4 bits of hash.
+inline double grad(int hash, double x, double y, double z) {
+  int h = hash & 15;
+  double u = h < 8 ? x : y;
+  double v = h < 4 ? y : (h == 12 || h == 14 ? x : z);
+  return ((h & 1) ? - u : u) + ((h & 2) ? - v : v);
+}
+
+} // namespace
+
+BrickedNoise::BrickedNoise(double frequency, int octaves, double spacing,
+                           size_t budget, uint32_t seed)
+  : frequency(frequency), octaves(std::max(octaves, 1)), spacing(spacing) {
+  double amplitudes = 0., amplitude = 1.;
+  for (int o = 0; o < this->octaves; o++, amplitude *= .5)
+    amplitudes += amplitude;
+  norm = float(1. / amplitudes);
+
+  PCG32 rng(hash_uint64(seed));
+  for (int i = 0; i < 256; i++) perm[i] = i;
+  for (int i = 255; i > 0; i--)
+    std::swap(perm[i], perm[rng.next_uint() % (i + 1)]);
+  for (int i = 0; i < 256; i++) perm[256 + i] = perm[i];
+
+  // a power of two of sets, so that a key's hash picks one by masking
+  numSets = 1;
+  while (2 * numSets * sizeof(Set) <= budget) numSets *= 2;
+  sets = new Set[numSets];
+  for (size_t i = 0; i < numSets; i++) {
+    for (size_t w = 0; w < kWays; w++) {
+      Slot& slot = sets[i].ways[w];
+      slot.sequence.store(0, std::memory_order_relaxed);
+      slot.key.store(kNoBrick, std::memory_order_relaxed);
+      slot.referenced.store(false, std::memory_order_relaxed);
+    }
+    sets[i].hand = 0;
+  }
+}
+
+BrickedNoise::~BrickedNoise() {
+  delete[] sets;
+}
+
+float BrickedNoise::gradient_noise(double x, double y, double z) const {
+  double fx = floor(x), fy = floor(y), fz = floor(z);
+  int X = int(int64_t(fx) & 255), Y = int(int64_t(fy) & 255), Z = int(int64_t(fz) & 255);
+  x -= fx; y -= fy; z -= fz;
+  double u = fade(x), v = fade(y), w = fade(z);
+  int A = perm[X] + Y, AA = perm[A] + Z, AB = perm[A + 1] + Z;
+  int B = perm[X + 1] + Y, BA = perm[B] + Z, BB = perm[B + 1] + Z;
+  return float(lerp(w, lerp(v, lerp(u, grad(perm[AA], x, y, z),
+                                        grad(perm[BA], x - 1., y, z)),
+                               lerp(u, grad(perm[AB], x, y - 1., z),
+                                        grad(perm[BB], x - 1., y - 1., z))),
+                       lerp(v, lerp(u, grad(perm[AA + 1], x, y, z - 1.),
+                                        grad(perm[BA + 1], x - 1., y, z - 1.)),
+                               lerp(u, grad(perm[AB + 1], x, y - 1., z - 1.),
+                                        grad(perm[BB + 1], x - 1., y - 1., z - 1.)))));
+}
+
+float BrickedNoise::evaluate(const Vector3D& p) const {
+  double f = frequency;
+  float amplitude = 1.f, sum = 0.f;
+  for (int o = 0; o < octaves; o++, f *= 2., amplitude *= .5f)
+    sum += amplitude * gradient_noise(p.x * f, p.y * f, p.z * f);
+  return std::min(std::max(sum * norm, -1.f), 1.f);
+}
+
+void BrickedNoise::fill(int64_t bx, int64_t by, int64_t bz, float* samples) const {
+  std::fill(samples, samples + kBrickSamples, 0.f);
+  const int64_t origin[3] = {bx * kBrickSize, by * kBrickSize, bz * kBrickSize};
+  double f = frequency;
+  float amplitude = 1.f;
+  for (int o = 0; o < octaves; o++, f *= 2., amplitude *= .5f) {
+    // the lattice cell, offset in it and fade of the samples along each axis
+    int cell[3][kBrickSide];
+    float offset[3][kBrickSide], faded[3][kBrickSide];
+    for (int a = 0; a < 3; a++) {
+      for (int i = 0; i < kBrickSide; i++) {
+        double x = (origin[a] + i) * spacing * f;
+        double fx = floor(x);
+        cell[a][i] = int(int64_t(fx) & 255);
+        offset[a][i] = float(x - fx);
+        faded[a][i] = float(fade(x - fx));
+      }
+    }
+    for (int k = 0; k < kBrickSide; k++) {
+      int Z = cell[2][k];
+      float z = offset[2][k], w = faded[2][k];
+      for (int j = 0; j < kBrickSide; j++) {
+        int Y = cell[1][j];
+        float y = offset[1][j], v = faded[1][j];
+        float* row = samples + kBrickSide * (j + kBrickSide * k);
+        int i0 = 0;
+        while (i0 < kBrickSide) {
+          int X = cell[0][i0], i1 = i0 + 1;
+          while (i1 < kBrickSide && cell[0][i1] == X) i1++;
+          // with y and z fixed, the four corners of each face of the cell at
+          // x = 0 and x = 1 blend into a linear function of x, a x + b
+          float a[2] = {0.f, 0.f}, b[2] = {0.f, 0.f};
+          for (int cx = 0; cx < 2; cx++)
+            for (int cy = 0; cy < 2; cy++)
+              for (int cz = 0; cz < 2; cz++) {
+                int h = perm[perm[perm[X + cx] + Y + cy] + Z + cz];
+                float weight = (cy ? v : 1.f - v) * (cz ? w : 1.f - w);
+                a[cx] += weight * float(grad(h, 1., 0., 0.));
+                b[cx] += weight * float(grad(h, - cx, y - cy, z - cz));
+              }
+          for (int i = i0; i < i1; i++) {
+            float x = offset[0][i];
+            float n0 = a[0] * x + b[0], n1 = a[1] * x + b[1];
+            row[i] += amplitude * (n0 + faded[0][i] * (n1 - n0));
+          }
+          i0 = i1;
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < kBrickSamples; i++)
+    samples[i] = std::min(std::max(samples[i] * norm, -1.f), 1.f);
+}
+
+bool BrickedNoise::read(Slot& slot, uint64_t key, size_t offset, float* c) const {
+  uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if ((sequence & 1) || slot.key.load(std::memory_order_relaxed) != key)
+    return false;
+  const std::atomic<float>* s = slot.samples + offset;
+  const size_t dy = kBrickSide, dz = kBrickSide * kBrickSide;
+  const size_t corners[8] = {0, 1, dy, dy + 1, dz, dz + 1, dz + dy, dz + dy + 1};
+  for (int i = 0; i < 8; i++)
+    c[i] = s[corners[i]].load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+    return false;
+  if (!slot.referenced.load(std::memory_order_relaxed))
+    slot.referenced.store(true, std::memory_order_relaxed);
+  return true;
+}
+
+void BrickedNoise::insert(size_t index, uint64_t key, const float* samples) const {
+  std::lock_guard<std::mutex> lock(locks[index % kLocks]);
+  Set& set = sets[index];
+  for (size_t w = 0; w < kWays; w++)
+    if (set.ways[w].key.load(std::memory_order_relaxed) == key) return;
+
+  // take an empty way, else sweep the hand past referenced bricks
+  size_t way = 0;
+  while (way < kWays && set.ways[way].key.load(std::memory_order_relaxed) != kNoBrick)
+    way++;
+  if (way == kWays) {
+    while (set.ways[set.hand].referenced.exchange(false, std::memory_order_relaxed))
+      set.hand = (set.hand + 1) % kWays;
+    way = set.hand;
+    set.hand = (set.hand + 1) % kWays;
+  }
+
+  Slot& slot = set.ways[way];
+  uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.key.store(key, std::memory_order_relaxed);
+  for (size_t i = 0; i < kBrickSamples; i++)
+    slot.samples[i].store(samples[i], std::memory_order_relaxed);
+  slot.referenced.store(true, std::memory_order_relaxed);
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+float BrickedNoise::lookup(const Vector3D& p) const {
+  int64_t brick[3];
+  int local[3];
+  float t[3];
+  for (int a = 0; a < 3; a++) {
+    double g = p[a] / spacing;
+    double cell = floor(g);
+    t[a] = float(g - cell);
+    brick[a] = floor_div(int64_t(cell), kBrickSize);
+    local[a] = int(int64_t(cell) - brick[a] * kBrickSize);
+  }
+  uint64_t key = 0;
+  for (int a = 0; a < 3; a++)
+    key = (key << 21) | (uint64_t(brick[a] + kKeyOffset) & kKeyMask);
+  size_t index = hash_uint64(key) & (numSets - 1);
+  size_t offset = local[0] + kBrickSide * (local[1] + kBrickSide * local[2]);
+
+  float c[8];
+  size_t way = 0;
+  while (way < kWays && !read(sets[index].ways[way], key, offset, c)) way++;
+  if (way == kWays) {
+    // a miss, or a read that raced a writer: evaluate the brick unlocked
+    float samples[kBrickSamples];
+    fill(brick[0], brick[1], brick[2], samples);
+    insert(index, key, samples);
+    const float* s = samples + offset;
+    const size_t dy = kBrickSide, dz = kBrickSide * kBrickSide;
+    c[0] = s[0];      c[1] = s[1];
+    c[2] = s[dy];     c[3] = s[dy + 1];
+    c[4] = s[dz];     c[5] = s[dz + 1];
+    c[6] = s[dz + dy]; c[7] = s[dz + dy + 1];
+  }
+  float x0 = c[0] + (c[1] - c[0]) * t[0], x1 = c[2] + (c[3] - c[2]) * t[0];
+  float x2 = c[4] + (c[5] - c[4]) * t[0], x3 = c[6] + (c[7] - c[6]) * t[0];
+  float y0 = x0 + (x1 - x0) * t[1], y1 = x2 + (x3 - x2) * t[1];
+  return y0 + (y1 - y0) * t[2];
+}
+
+} // namespace CGL
@@ -0,0 +1,125 @@
+#ifndef CGL_BRICKEDNOISE_H
+#define CGL_BRICKEDNOISE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "CGL/vector3D.h"
+
+namespace CGL {
+
+/**
+ * Fractal Brownian motion of gradient noise, for the density of procedural
+ * media. The noise is sampled on a lattice and interpolated trilinearly.
+ * The samples are evaluated a brick of 8^3 lattice cells at a time, the
+ * first time a lookup lands in the brick, and kept in a cache of bounded
+ * memory. The cache is 8-way set associative and each set evicts bricks
+ * by the clock approximation of least recently used. Lookups that hit take
+ * no lock: each cached brick is guarded by a sequence number, odd while the
+ * brick is being written, and a reader that sees it change retries as a
+ * miss. A miss evaluates its brick before taking the lock of its set, which
+ * only serializes the writers. A lookup depends only on the point and the
+ * seed, never on what the cache holds.
+ */
+class BrickedNoise {
+ public:
+
+  /**
+   * Constructor.
+   * \param frequency frequency of the first octave, per unit
+   * \param octaves number of octaves, each of twice the frequency and half
+   *        the amplitude of the one before
+   * \param spacing distance between lattice samples
+   * \param budget bytes the cached bricks may take, at least one set's
+   * \param seed seed of the permutation picking the gradients
+   */
+  BrickedNoise(double frequency, int octaves, double spacing, size_t budget,
+               uint32_t seed = 0);
+
+  /**
+   * Destructor.
+   */
+  ~BrickedNoise();
+
+  /**
+   * Look up the noise at p, in [-1, 1]. p must lie within 2^20 bricks of
+   * the origin.
+   */
+  float lookup(const Vector3D& p) const;
+
+  /**
+   * Evaluate the noise at p off the lattice, in [-1, 1].
+   */
+  float evaluate(const Vector3D& p) const;
+
+  /**
+   * Get the number of bricks the cache holds at most.
+   */
+  size_t capacity() const { return numSets * kWays; }
+
+ private:
+
+  static const int kBrickSize = 8;                   ///< cells along each side
+  static const int kBrickSide = kBrickSize + 1;      ///< samples along each side
+  static const size_t kBrickSamples = kBrickSide * kBrickSide * kBrickSide;
+  static const size_t kWays = 8;
+  static const size_t kLocks = 64;
+  static const uint64_t kNoBrick = ~uint64_t(0);
+
+  struct Slot {
+    std::atomic<uint32_t> sequence;   ///< odd while the brick is written
+    std::atomic<uint64_t> key;        ///< packed brick coordinates, kNoBrick if none
+    std::atomic<bool> referenced;     ///< looked up since the clock hand passed
+    std::atomic<float> samples[kBrickSamples];
+  };
+
+  struct Set {
+    Slot ways[kWays];
+    size_t hand;                      ///< next way the clock considers evicting
+  };
+
+  // the sets hold atomics and are never copied
+  BrickedNoise(const BrickedNoise&);
+  BrickedNoise& operator=(const BrickedNoise&);
+
+  /**
+   * Evaluate the samples of brick (bx, by, bz) octave by octave. Within an
+   * octave the samples of a row that share a lattice cell differ only in
+   * their offset along x, so the cell's gradients are gathered once and the
+   * run of samples is evaluated in a loop of plain arithmetic over arrays,
+   * which the compiler vectorizes.
+   */
+  void fill(int64_t bx, int64_t by, int64_t bz, float* samples) const;
+
+  /**
+   * Copy the 8 corners at offset out of the brick in slot if it holds the
+   * brick of key and no writer raced the copy.
+   */
+  bool read(Slot& slot, uint64_t key, size_t offset, float* c) const;
+
+  /**
+   * Publish the samples of the brick of key in set index, unless another
+   * thread already has.
+   */
+  void insert(size_t index, uint64_t key, const float* samples) const;
+
+  /**
+   * Improved Perlin noise at (x, y, z), in [-1, 1].
+   */
+  float gradient_noise(double x, double y, double z) const;
+
+  double frequency;
+  int octaves;
+  double spacing;
+  float norm;          ///< reciprocal of the sum of the octaves' amplitudes
+  int perm[512];       ///< permutation of 0 to 255, repeated
+
+  Set* sets;
+  size_t numSets;      ///< a power of two
+  mutable std::mutex locks[kLocks];   ///< striped over the sets, for writers
+};
+
+} // namespace CGL
+
+#endif // CGL_BRICKEDNOISE_H
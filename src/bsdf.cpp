@@ -140,6 +140,15 @@ Spectrum MicrofacetBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf)
   // return MicrofacetBSDF::f(wo, *wi);
 }
 
+float MicrofacetBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  if (wo.z <= 0 || wi.z <= 0) return 0.;
+
+  // sample_f picks h with pdf D(h) cos(theta_h)
+  Vector3D h = wo + wi;
+  h.normalize();
+  return D(h) * cos_theta(h) / (4 * dot(wi, h));
+}
+
 // Refraction BSDF //
 
 Spectrum RefractionBSDF::f(const Vector3D& wo, const Vector3D& wi) {
@@ -227,4 +236,8 @@ Spectrum EmissionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
   return Spectrum();
 }
 
+float EmissionBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+  return wi.z > 0 ? wi.z / PI : 0.;
+}
+
 } // namespace CGL
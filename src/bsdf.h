@@ -79,6 +79,15 @@ class BSDF {
    */
   virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf) = 0;
 
+  /**
+   * Get the pdf with which sample_f returns wi given wo, with respect to
+   * solid angle. This is zero for delta BSDFs.
+   * \param wo outgoing light direction in local space of point of intersection
+   * \param wi incident light direction in local space of point of intersection
+   * \return pdf of sampling wi
+   */
+  virtual float pdf (const Vector3D& wo, const Vector3D& wi) = 0;
+
   /**
    * Get the emission value of the surface material. For non-emitting surfaces
    * this would be a zero energy spectrum.
@@ -95,6 +104,12 @@ class BSDF {
    */
   virtual bool is_delta() const = 0;
 
+  /**
+   * If the BSDF is Lambertian, so that the light it reflects depends only
+   * on the irradiance and f is the same for all pairs of directions.
+   */
+  virtual bool is_diffuse() const { return false; }
+
   /**
    * Reflection helper
    */
@@ -120,8 +135,10 @@ class DiffuseBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
+  bool is_diffuse() const { return true; }
 
 private:
 
@@ -140,6 +157,7 @@ class MirrorBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi) { return 0; }
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
 
@@ -178,6 +196,7 @@ class MicrofacetBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
 
@@ -199,6 +218,7 @@ class RefractionBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi) { return 0; }
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
 
@@ -223,6 +243,7 @@ class GlassBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi) { return 0; }
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return true; }
 
@@ -245,6 +266,7 @@ class EmissionBSDF : public BSDF {
 
   Spectrum f(const Vector3D& wo, const Vector3D& wi);
   Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  float pdf(const Vector3D& wo, const Vector3D& wi);
   Spectrum get_emission() const { return radiance; }
   bool is_delta() const { return false; }
 
@@ -1,5 +1,6 @@
 #include "collada.h"
 #include "math.h"
+#include "../phase.h"
 
 #include <assert.h>
 #include <map>
@@ -911,6 +912,37 @@ void ColladaParser::parse_material ( XMLElement* xml, MaterialInfo& material ) {
           float ior = atof(e_ior->GetText());
           BSDF* bsdf = new GlassBSDF(transmittance, reflectance, roughness, ior);
           material.bsdf = bsdf;
+        } else if (type == "medium") {
+          XMLElement *e_grid = get_element(e_bsdf, "grid");
+          if (e_grid) {
+            string filename = e_grid->GetText();
+            material.medium = GridMedium::load(filename);
+            if (!material.medium) {
+              stat("Error: could not load grid " << filename << " in material: " << material.id);
+              exit(EXIT_FAILURE);
+            }
+          } else {
+            XMLElement *e_extinction = get_element(e_bsdf, "extinction");
+            XMLElement *e_scattering = get_element(e_bsdf, "scattering");
+            if (!e_extinction || !e_scattering) {
+              stat("Error: incomplete definition of medium in material: " << material.id);
+              exit(EXIT_FAILURE);
+            }
+            float extinction = atof(e_extinction->GetText());
+            float scattering = atof(e_scattering->GetText());
+            HomogeneousMedium* medium = new HomogeneousMedium(extinction, scattering);
+            XMLElement *e_phase = get_element(e_bsdf, "phase");
+            if (e_phase) {
+              string filename = e_phase->GetText();
+              TabulatedPhase* phase = TabulatedPhase::load(filename);
+              if (!phase) {
+                stat("Error: could not load phase function " << filename << " in material: " << material.id);
+                exit(EXIT_FAILURE);
+              }
+              medium->set_phase_function(phase);
+            }
+            material.medium = medium;
+          }
         }
         e_bsdf = e_bsdf->NextSiblingElement();
       }
@@ -8,7 +8,7 @@ std::ostream& operator<<(std::ostream& os, const MaterialInfo& material) {
 
   os << "MaterialInfo: " << material.name << " (id:" << material.id << ")";
 
-  os << " [" << " BSDF=" << material.bsdf << " ]";
+  os << " [" << " BSDF=" << material.bsdf << " Medium=" << material.medium << " ]";
 
   return os;
 }
@@ -4,12 +4,14 @@
 #include "CGL/color.h"
 #include "collada_info.h"
 #include "../bsdf.h"
+#include "../medium.h"
 
 namespace CGL { namespace Collada {
 
 struct MaterialInfo : public Instance {
 
   BSDF* bsdf;
+  Medium* medium;  ///< medium inside the object, NULL if none
   
 //   Texture* tex; ///< texture
 
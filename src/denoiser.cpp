@@ -0,0 +1,108 @@
+#include "denoiser.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace CGL {
+
+namespace {
+
+// Luminance differences within this many standard deviations of the noise
+// are smoothed.
+const double kSigmaLuminance = 4.;
+
+// Exponent of the cosine between normals.
+const double kSigmaNormal = 128.;
+
+// Depth differences, relative to the depth, that are smoothed.
+const double kSigmaDepth = .1;
+
+// Sum of the absolute albedo differences that are smoothed.
+const double kSigmaAlbedo = .1;
+
+// B3 spline weights, by the distance from the center tap.
+const double kKernel[3] = {3. / 8., 1. / 4., 1. / 16.};
+
+// Channels with less albedo than this are filtered as they are.
+const float kMinAlbedo = 1e-3f;
+
+Spectrum demodulate(const Spectrum& c, const Spectrum& a) {
+  return Spectrum(a.r > kMinAlbedo ? c.r / a.r : c.r,
+                  a.g > kMinAlbedo ? c.g / a.g : c.g,
+                  a.b > kMinAlbedo ? c.b / a.b : c.b);
+}
+
+Spectrum remodulate(const Spectrum& c, const Spectrum& a) {
+  return Spectrum(a.r > kMinAlbedo ? c.r * a.r : c.r,
+                  a.g > kMinAlbedo ? c.g * a.g : c.g,
+                  a.b > kMinAlbedo ? c.b * a.b : c.b);
+}
+
+} // namespace
+
+void Denoiser::denoise(HDRImageBuffer* image, const std::vector<Spectrum>& albedo,
+                       const std::vector<Vector3D>& normal,
+                       const std::vector<double>& depth,
+                       const std::vector<double>& variance) const {
+  int w = image->w, h = image->h;
+  size_t n = image->data.size();
+
+  std::vector<Spectrum> color(n), filtered(n);
+  std::vector<double> var(n), filtered_var(n);
+  std::vector<Vector3D> unit_normal(n);
+  for (size_t i = 0; i < n; i++) {
+    color[i] = demodulate(image->data[i], albedo[i]);
+    double a = albedo[i].illum();
+    var[i] = a > kMinAlbedo ? variance[i] / (a * a) : variance[i];
+    double len = normal[i].norm();
+    unit_normal[i] = len > 0 ? normal[i] / len : Vector3D();
+  }
+
+  for (size_t k = 0; k < iterations; k++) {
+    int step = 1 << k;
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        size_t p = x + y * w;
+        double l_p = color[p].illum();
+
+        Spectrum sum;
+        double weight_sum = 0., var_sum = 0.;
+        for (int dy = -2; dy <= 2; dy++) {
+          int qy = y + dy * step;
+          if (qy < 0 || qy >= h) continue;
+          for (int dx = -2; dx <= 2; dx++) {
+            int qx = x + dx * step;
+            if (qx < 0 || qx >= w) continue;
+            size_t q = qx + qy * w;
+
+            double weight = kKernel[abs(dx)] * kKernel[abs(dy)];
+            if (q != p) {
+              Spectrum da = albedo[p] - albedo[q];
+              double dz = fabs(depth[p] - depth[q]) /
+                          (kSigmaDepth * std::max(depth[p], depth[q]) + 1e-6);
+              // symmetric in p and q, so that the light an outlier loses to
+              // its neighbours is what they take from it
+              double sigma_l = kSigmaLuminance * sqrt(var[p] + var[q]) + 1e-6;
+              weight *= exp(-fabs(l_p - color[q].illum()) / sigma_l - dz -
+                            (fabs(da.r) + fabs(da.g) + fabs(da.b)) / kSigmaAlbedo) *
+                        pow(std::max(0., dot(unit_normal[p], unit_normal[q])), kSigmaNormal);
+            }
+            sum += color[q] * weight;
+            weight_sum += weight;
+            var_sum += weight * weight * var[q];
+          }
+        }
+        filtered[p] = sum * (1. / weight_sum);
+        filtered_var[p] = var_sum / (weight_sum * weight_sum);
+      }
+    }
+    color.swap(filtered);
+    var.swap(filtered_var);
+  }
+
+  for (size_t i = 0; i < n; i++)
+    image->data[i] = remodulate(color[i], albedo[i]);
+}
+
+} // namespace CGL
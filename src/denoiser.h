@@ -0,0 +1,46 @@
+#ifndef CGL_DENOISER_H
+#define CGL_DENOISER_H
+
+#include <vector>
+
+#include "CGL/spectrum.h"
+#include "CGL/vector3D.h"
+#include "image.h"
+
+namespace CGL {
+
+/**
+ * Removes the noise of a finished render with the edge-avoiding a-trous
+ * wavelet transform (Dammertz et al. 2010): 5x5 B3 spline filters applied
+ * repeatedly with doubling spacing. The weights of a tap fall off across
+ * edges of the first-hit normal, depth and albedo, and with luminance
+ * differences the pixels' variance does not explain (Schied et al. 2017).
+ * The lighting is filtered apart from the albedo, so textures stay sharp.
+ */
+class Denoiser {
+ public:
+
+  /**
+   * Constructor.
+   * \param iterations number of filter passes, reaching 2^(iterations + 1)
+   *                   pixels away
+   */
+  Denoiser(size_t iterations = 5) : iterations(iterations) { }
+
+  /**
+   * Denoise image in place. albedo, normal and depth are the averages of
+   * each pixel's first-hit features, variance the variance of the mean
+   * luminance of each pixel.
+   */
+  void denoise(HDRImageBuffer* image, const std::vector<Spectrum>& albedo,
+               const std::vector<Vector3D>& normal,
+               const std::vector<double>& depth,
+               const std::vector<double>& variance) const;
+
+ private:
+  size_t iterations;
+};
+
+} // namespace CGL
+
+#endif // CGL_DENOISER_H
@@ -27,9 +27,13 @@ Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform) {
   }
 
   mesh.build(polygons, vertices);  
+  bsdf = NULL;
+  medium = NULL;
   if (polyMesh.material) {
     bsdf = polyMesh.material->bsdf;
-  } else {
+    medium = polyMesh.material->medium;
+  }
+  if (!bsdf) {
     bsdf = new DiffuseBSDF(Spectrum(0.5f,0.5f,0.5f));
   }
 }
@@ -506,7 +510,7 @@ BSDF* Mesh::get_bsdf() {
 }
 
 StaticScene::SceneObject *Mesh::get_static_object() {
-  return new StaticScene::Mesh(mesh, bsdf);
+  return new StaticScene::Mesh(mesh, bsdf, medium);
 }
 
 
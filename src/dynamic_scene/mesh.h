@@ -113,6 +113,7 @@ class Mesh : public SceneObject, public MeshView {
 
   // material
   BSDF* bsdf;
+  Medium* medium;
 };
 
 } // namespace DynamicScene
@@ -1,5 +1,8 @@
 #include "scene.h"
 
+#include "../static_scene/object.h"
+#include "../static_scene/light.h"
+
 using std::cout;
 using std::endl;
 
@@ -137,8 +140,51 @@ StaticScene::Scene *Scene::get_static_scene() {
   for (SceneObject *obj : objects) {
     staticObjects.push_back(obj->get_static_object());
   }
+  std::vector<StaticScene::AreaLight *> areaLights;
   for (SceneLight *light : lights) {
-    staticLights.push_back(light->get_static_light());
+    StaticScene::SceneLight *staticLight = light->get_static_light();
+    if (StaticScene::AreaLight *areaLight =
+          dynamic_cast<StaticScene::AreaLight *>(staticLight)) {
+      areaLights.push_back(areaLight);
+    }
+    staticLights.push_back(staticLight);
+  }
+
+  // Register emissive geometry as lights so that light sampling also reaches
+  // it. Scenes exported with an explicit area light (the Cornell boxes) use
+  // it as the sampling stand-in for the emissive quad, so registering the
+  // quad as well would count the same emitter twice. Only the emitters that
+  // an area light lies on are skipped; every other one is registered.
+  for (StaticScene::SceneObject *obj : staticObjects) {
+    BSDF *bsdf = obj->get_bsdf();
+    if (!bsdf || bsdf->get_emission() == Spectrum()) continue;
+
+    StaticScene::Mesh *mesh = dynamic_cast<StaticScene::Mesh *>(obj);
+    StaticScene::SphereObject *sphere =
+      dynamic_cast<StaticScene::SphereObject *>(obj);
+    BBox box;
+    if (mesh) {
+      for (size_t i : mesh->get_indices()) box.expand(mesh->positions[i]);
+    } else if (sphere) {
+      Vector3D r(sphere->r, sphere->r, sphere->r);
+      box = BBox(sphere->o - r, sphere->o + r);
+    } else {
+      continue;
+    }
+
+    bool standIn = false;
+    for (StaticScene::AreaLight *areaLight : areaLights) {
+      if (areaLight->lies_in(box)) standIn = true;
+    }
+    if (standIn) continue;
+
+    if (mesh) {
+      staticLights.push_back(
+        new StaticScene::MeshLight(bsdf->get_emission(), mesh));
+    } else {
+      staticLights.push_back(
+        new StaticScene::SphereLight(bsdf->get_emission(), sphere));
+    }
   }
 
   return new StaticScene::Scene(staticObjects, staticLights);
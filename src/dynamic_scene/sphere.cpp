@@ -8,9 +8,13 @@ namespace CGL { namespace DynamicScene {
 Sphere::Sphere(const Collada::SphereInfo& info, 
                const Vector3D& position, const double scale) : 
   p(position), r(info.radius * scale) { 
+  bsdf = NULL;
+  medium = NULL;
   if (info.material) {
     bsdf = info.material->bsdf;
-  } else {
+    medium = info.material->medium;
+  }
+  if (!bsdf) {
     bsdf = new DiffuseBSDF(Spectrum(0.5f,0.5f,0.5f));    
   }
 }
@@ -33,7 +37,7 @@ BSDF* Sphere::get_bsdf() {
 }
 
 StaticScene::SceneObject *Sphere::get_static_object() {
-  return new StaticScene::SphereObject(p, r, bsdf);
+  return new StaticScene::SphereObject(p, r, bsdf, medium);
 }
 
 } // namespace DynamicScene
@@ -40,6 +40,7 @@ class Sphere : public SceneObject {
   double r;
   Vector3D p;
   BSDF* bsdf;
+  Medium* medium;
   DrawStyle *style;
 
 };
@@ -0,0 +1,243 @@
+#include "guiding_field.h"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "CGL/CGL.h"
+#include "random_util.h"
+
+namespace CGL {
+
+namespace {
+
+// Records are summed as integers in units of 2^-16, after clamping, so
+// that the sums do not depend on the order they were added in.
+const double kFixedPointScale = 65536.;
+const double kMaxRecord = 1e6;
+
+// Number of records a cell needs before lookups trust it.
+const uint32_t kMinRecords = 128;
+
+// A quadrant is refined while it holds more than this fraction of the
+// energy of its tree, down to kMaxDepth levels.
+const double kRefineFraction = 0.01;
+const int kMaxDepth = 10;
+
+Vector2D direction_to_square(const Vector3D& w) {
+  double phi = atan2(w.y, w.x);
+  if (phi < 0) phi += 2. * PI;
+  return Vector2D(std::min(std::max((w.z + 1.) * .5, 0.), 1. - 1e-9),
+                  std::min(phi / (2. * PI), 1. - 1e-9));
+}
+
+Vector3D square_to_direction(const Vector2D& u) {
+  double z = 2. * u.x - 1.;
+  double r = sqrt(std::max(0., 1. - z * z));
+  double phi = 2. * PI * u.y;
+  return Vector3D(r * cos(phi), r * sin(phi), z);
+}
+
+// Picks the lower half of [0, 1) with probability fraction and stretches u
+// over the half it picked.
+bool pick_lower(double fraction, double* u) {
+  if (*u < fraction) {
+    *u = std::min(*u / fraction, 1. - 1e-9);
+    return true;
+  }
+  *u = std::min((*u - fraction) / (1. - fraction), 1. - 1e-9);
+  return false;
+}
+
+} // namespace
+
+// Directional Tree //
+
+DirectionalTree::DirectionalTree() : nodes(NULL), num_nodes(0) {
+  clear();
+}
+
+DirectionalTree::~DirectionalTree() {
+  delete[] nodes;
+}
+
+void DirectionalTree::clear() {
+  delete[] nodes;
+  nodes = new Node[1];
+  num_nodes = 1;
+  for (int q = 0; q < 4; q++) {
+    nodes[0].child[q] = 0;
+    nodes[0].sum[q] = 0;
+    nodes[0].energy[q] = 1.f;
+  }
+}
+
+Vector3D DirectionalTree::sample(Vector2D u) const {
+  // hierarchical sample warping: pick the column of quadrants by their
+  // marginal energy, then the quadrant within it, reusing u at each level
+  const Node* node = nodes;
+  Vector2D origin(0, 0);
+  double size = 1.;
+  while (true) {
+    const float* e = node->energy;
+    double left = e[0] + e[2], right = e[1] + e[3];
+    int x = pick_lower(left / (left + right), &u.x) ? 0 : 1;
+    int y = pick_lower(e[x] / (e[x] + e[x + 2]), &u.y) ? 0 : 1;
+    int q = x + 2 * y;
+    size *= .5;
+    origin += Vector2D(x, y) * size;
+    if (!node->child[q]) break;
+    node = nodes + node->child[q];
+  }
+  return square_to_direction(origin + u * size);
+}
+
+double DirectionalTree::pdf(const Vector3D& w) const {
+  Vector2D u = direction_to_square(w);
+  const Node* node = nodes;
+  double density = 1.;
+  while (true) {
+    const float* e = node->energy;
+    double total = e[0] + e[1] + e[2] + e[3];
+    int x = u.x >= .5, y = u.y >= .5;
+    int q = x + 2 * y;
+    density *= 4. * e[q] / total;
+    if (density == 0 || !node->child[q]) break;
+    u = u * 2. - Vector2D(x, y);
+    node = nodes + node->child[q];
+  }
+  // the map to the square preserves area up to the factor 4 pi
+  return density / (4. * PI);
+}
+
+void DirectionalTree::record(const Vector3D& w, uint64_t value) {
+  Vector2D u = direction_to_square(w);
+  Node* node = nodes;
+  while (true) {
+    int x = u.x >= .5, y = u.y >= .5;
+    int q = x + 2 * y;
+    if (!node->child[q]) {
+      node->sum[q].fetch_add(value, std::memory_order_relaxed);
+      return;
+    }
+    u = u * 2. - Vector2D(x, y);
+    node = nodes + node->child[q];
+  }
+}
+
+uint64_t DirectionalTree::subtree_energy(uint32_t i, std::vector<uint64_t>* totals) const {
+  uint64_t total = 0;
+  for (int q = 0; q < 4; q++) {
+    uint32_t c = nodes[i].child[q];
+    total += c ? subtree_energy(c, totals) : nodes[i].sum[q].load(std::memory_order_relaxed);
+  }
+  return (*totals)[i] = total;
+}
+
+uint32_t DirectionalTree::build(const Node* old, uint64_t spread, int depth,
+                                uint64_t threshold,
+                                const std::vector<uint64_t>& totals,
+                                std::vector<BuildNode>* built) const {
+  uint32_t index = built->size();
+  built->push_back(BuildNode());
+  for (int q = 0; q < 4; q++) {
+    // a quadrant the old tree did not have takes a quarter of its parent
+    const Node* old_child = NULL;
+    uint64_t energy = spread / 4;
+    if (old && old->child[q]) {
+      old_child = nodes + old->child[q];
+      energy = totals[old->child[q]];
+    } else if (old) {
+      energy = old->sum[q].load(std::memory_order_relaxed);
+    }
+    uint32_t child = 0;
+    if (depth < kMaxDepth && energy > threshold)
+      child = build(old_child, energy, depth + 1, threshold, totals, built);
+    (*built)[index].child[q] = child;
+    (*built)[index].sum[q] = child ? 0 : energy;
+    (*built)[index].energy[q] = energy;
+  }
+  return index;
+}
+
+bool DirectionalTree::rebuild() {
+  std::vector<uint64_t> totals(num_nodes, 0);
+  uint64_t root_total = subtree_energy(0, &totals);
+  if (!root_total) return false;
+
+  // refine the quadrants above the threshold, spreading the records of a
+  // new leaf evenly over its quadrants; merge the subtrees below it
+  uint64_t threshold = std::max<uint64_t>(uint64_t(root_total * kRefineFraction), 4);
+  std::vector<BuildNode> built;
+  build(nodes, 0, 1, threshold, totals, &built);
+
+  Node* rebuilt = new Node[built.size()];
+  for (size_t i = 0; i < built.size(); i++) {
+    for (int q = 0; q < 4; q++) {
+      rebuilt[i].child[q] = built[i].child[q];
+      rebuilt[i].sum[q] = built[i].sum[q];
+      rebuilt[i].energy[q] = float(built[i].energy[q]);
+    }
+  }
+  delete[] nodes;
+  nodes = rebuilt;
+  num_nodes = built.size();
+  return true;
+}
+
+// Guiding Field //
+
+GuidingField::GuidingField(size_t log2_size) {
+  mask = (size_t(1) << log2_size) - 1;
+  cells = new Cell[mask + 1];
+  reset(BBox(Vector3D(0, 0, 0), Vector3D(1, 1, 1)));
+}
+
+GuidingField::~GuidingField() {
+  delete[] cells;
+}
+
+void GuidingField::reset(const BBox& bounds, size_t resolution) {
+  double extent = std::max(bounds.extent.x, std::max(bounds.extent.y, bounds.extent.z));
+  origin = bounds.min;
+  inv_cell_size = extent > 0 ? resolution / extent : 1.;
+  for (size_t i = 0; i <= mask; i++) {
+    cells[i].tree.clear();
+    cells[i].count = 0;
+    cells[i].updated_count = 0;
+    cells[i].trained = false;
+  }
+}
+
+size_t GuidingField::cell_index(const Vector3D& p) const {
+  Vector3D q = (p - origin) * inv_cell_size;
+  uint64_t x = uint64_t(int64_t(floor(q.x))) & 0x1fffff;
+  uint64_t y = uint64_t(int64_t(floor(q.y))) & 0x1fffff;
+  uint64_t z = uint64_t(int64_t(floor(q.z))) & 0x1fffff;
+  return hash_uint64(x | y << 21 | z << 42) & mask;
+}
+
+void GuidingField::record(const Vector3D& p, const Vector3D& w,
+                          double radiance_over_pdf) {
+  Cell& cell = cells[cell_index(p)];
+  radiance_over_pdf = std::min(std::max(radiance_over_pdf, 0.), kMaxRecord);
+  cell.tree.record(w, uint64_t(radiance_over_pdf * kFixedPointScale));
+  cell.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GuidingField::update() {
+  for (size_t i = 0; i <= mask; i++) {
+    Cell& cell = cells[i];
+    uint32_t count = cell.count.load(std::memory_order_relaxed);
+    if (count < kMinRecords || count == cell.updated_count) continue;
+    cell.trained = cell.tree.rebuild();
+    cell.updated_count = count;
+  }
+}
+
+const DirectionalTree* GuidingField::lookup(const Vector3D& p) const {
+  const Cell& cell = cells[cell_index(p)];
+  return cell.trained ? &cell.tree : NULL;
+}
+
+} // namespace CGL
@@ -0,0 +1,148 @@
+#ifndef CGL_GUIDINGFIELD_H
+#define CGL_GUIDINGFIELD_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "CGL/vector2D.h"
+#include "CGL/vector3D.h"
+#include "bbox.h"
+
+namespace CGL {
+
+/**
+ * A directional distribution of incident radiance, stored as a quadtree
+ * over the cylindrical equal-area map of the sphere, u = (cos theta + 1) / 2
+ * and v = phi / 2pi (Mueller et al. 2017). Each quadrant of a node is either
+ * refined by a child node or a leaf of constant density.
+ */
+class DirectionalTree {
+ public:
+
+  DirectionalTree();
+  ~DirectionalTree();
+
+  /**
+   * Sample a world space direction by warping u through the tree.
+   */
+  Vector3D sample(Vector2D u) const;
+
+  /**
+   * Get the solid angle density of sampling w.
+   */
+  double pdf(const Vector3D& w) const;
+
+ private:
+  friend class GuidingField;
+
+  struct Node {
+    uint32_t child[4];             ///< node refining each quadrant, 0 for a leaf
+    std::atomic<uint64_t> sum[4];  ///< records of the leaf quadrants in fixed point
+    float energy[4];               ///< sampling weight of each quadrant
+  };
+
+  struct BuildNode {
+    uint32_t child[4];
+    uint64_t sum[4];
+    uint64_t energy[4];
+  };
+
+  /**
+   * Forget everything and sample uniformly.
+   */
+  void clear();
+
+  /**
+   * Add a record along w. Safe to call from several threads.
+   */
+  void record(const Vector3D& w, uint64_t value);
+
+  /**
+   * Refine the quadrants that hold much of the recorded energy, collapse
+   * those that hold little, and sample by the records from now on. Returns
+   * false if nothing has been recorded yet. Not thread safe.
+   */
+  bool rebuild();
+
+  /**
+   * Store the energy of the subtree under node i and its descendants in
+   * totals, and return it.
+   */
+  uint64_t subtree_energy(uint32_t i, std::vector<uint64_t>* totals) const;
+
+  /**
+   * Append the rebuilt version of the node old, or of a new node holding
+   * spread evenly if old is NULL, to built. Returns its index.
+   */
+  uint32_t build(const Node* old, uint64_t spread, int depth, uint64_t threshold,
+                 const std::vector<uint64_t>& totals,
+                 std::vector<BuildNode>* built) const;
+
+  Node* nodes;
+  uint32_t num_nodes;
+};
+
+/**
+ * Learns where the incident radiance comes from, to guide the directions
+ * paths continue in. Space is split by a hash grid like RadianceCache, and
+ * each cell holds a DirectionalTree. Paths record their radiance estimates
+ * while a pass renders; between passes, update() rebuilds the trees that
+ * lookup() hands out, so a pass never samples from what it is recording.
+ * Records are summed in fixed point and never reset, so every pass adds to
+ * what the earlier ones learned, and the trees do not depend on the order
+ * the threads recorded in.
+ */
+class GuidingField {
+ public:
+
+  /**
+   * Constructor.
+   * \param log2_size log2 of the number of hash table entries
+   */
+  GuidingField(size_t log2_size = 14);
+
+  ~GuidingField();
+
+  /**
+   * Forget everything and cover bounds with cells of about
+   * 1 / resolution of its largest extent.
+   */
+  void reset(const BBox& bounds, size_t resolution = 16);
+
+  /**
+   * Add the radiance arriving at p from direction w, divided by the pdf it
+   * was sampled with. Safe to call from several threads.
+   */
+  void record(const Vector3D& p, const Vector3D& w, double radiance_over_pdf);
+
+  /**
+   * Rebuild the distributions from the records so far. Not thread safe.
+   */
+  void update();
+
+  /**
+   * Get the distribution learned around p, or NULL if the cell around p
+   * does not have enough records yet.
+   */
+  const DirectionalTree* lookup(const Vector3D& p) const;
+
+ private:
+  struct Cell {
+    DirectionalTree tree;
+    std::atomic<uint32_t> count;  ///< number of records
+    uint32_t updated_count;       ///< number of records as of the last update
+    bool trained;                 ///< whether lookups hand out the tree
+  };
+
+  size_t cell_index(const Vector3D& p) const;
+
+  Cell* cells;
+  size_t mask;           ///< number of cells - 1
+  Vector3D origin;       ///< corner of the grid
+  double inv_cell_size;  ///< cells per unit length
+};
+
+} // namespace CGL
+
+#endif // CGL_GUIDINGFIELD_H
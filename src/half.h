@@ -0,0 +1,59 @@
+#ifndef CGL_HALF_H
+#define CGL_HALF_H
+
+#include <cstdint>
+#include <cstring>
+
+namespace CGL {
+
+/**
+ * Convert f to an IEEE 754 half precision float, rounding to nearest even.
+ * Values too large for a half become infinite.
+ */
+inline uint16_t float_to_half(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, 4);
+  uint16_t sign = (x >> 16) & 0x8000;
+  uint32_t abs = x & 0x7fffffff;
+  if (abs >= 0x7f800000)                     // infinity or NaN
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+  if (abs >= 0x477ff000) return sign | 0x7c00;  // rounds past the largest half
+  if (abs < 0x38800000) {                    // subnormal half or zero
+    if (abs < 0x33000000) return sign;
+    uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+    int shift = 126 - (abs >> 23);
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) half++;
+    return sign | half;
+  }
+  uint32_t half = (abs - 0x38000000) >> 13;
+  uint32_t rest = abs & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return sign | half;
+}
+
+/**
+ * Convert the IEEE 754 half precision float h to a float.
+ */
+inline float half_to_float(uint16_t h) {
+  uint32_t sign = uint32_t(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | mantissa << 13;
+  } else if (exponent) {
+    x = sign | (exponent + 112) << 23 | mantissa << 13;
+  } else {
+    // subnormal halves are normal floats
+    float f = mantissa * (1.f / 16777216.f);
+    return sign ? -f : f;
+  }
+  float f;
+  std::memcpy(&f, &x, 4);
+  return f;
+}
+
+} // namespace CGL
+
+#endif // CGL_HALF_H
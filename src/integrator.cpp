@@ -0,0 +1,274 @@
+#include "integrator.h"
+
+#include <algorithm>
+
+#include "CGL/CGL.h"
+#include "pathtracer.h"
+#include "sample_generator.h"
+
+using namespace CGL::StaticScene;
+
+namespace CGL {
+
+namespace {
+
+// Lowest throughput at which surface paths continue without roulette.
+const double kRouletteThreshold = 0.25;
+
+// Number of diffuse vertices of a path that record into the irradiance
+// cache.
+const size_t kMaxCacheRecords = 16;
+
+// A diffuse vertex waiting for the rest of its path to know its indirect
+// irradiance: the path's radiance after the vertex, divided by scale.
+struct CacheRecord {
+  Vector3D p, n;
+  Spectrum L_before;
+  Spectrum scale;
+};
+
+// Samples the cosine-weighted hemisphere around z with the pixel's
+// sample generator.
+Vector3D cosine_hemisphere_sample() {
+  Vector2D u = sample_2d();
+  double r = sqrt(u.x), phi = 2. * PI * u.y;
+  return Vector3D(r * cos(phi), r * sin(phi), sqrt(std::max(0., 1. - u.x)));
+}
+
+// Samples the hemisphere around z uniformly with the pixel's sample
+// generator.
+Vector3D uniform_hemisphere_sample() {
+  Vector2D u = sample_2d();
+  double r = sqrt(std::max(0., 1. - u.x * u.x)), phi = 2. * PI * u.y;
+  return Vector3D(r * cos(phi), r * sin(phi), u.x);
+}
+
+} // namespace
+
+// Ambient Occlusion Integrator //
+
+Spectrum AmbientOcclusionIntegrator::radiance(Ray& r,
+                                              RadianceComponents* components) {
+  PrimaryHit primary;
+  primary.hit = bvh->intersect(r, &primary.isect);
+  return radiance(r, primary, components);
+}
+
+Spectrum AmbientOcclusionIntegrator::radiance(Ray& r, const PrimaryHit& primary,
+                                              RadianceComponents* components) {
+  if (!primary.hit) return Spectrum();
+  const Intersection& isect = primary.isect;
+
+  // face the side the ray arrived from
+  Vector3D n = dot(isect.n, r.d) > 0 ? -isect.n : isect.n;
+  Matrix3x3 o2w;
+  make_coord_space(o2w, n);
+
+  Vector3D hit_p = r.o + r.d * isect.t;
+  Vector3D wi = o2w * cosine_hemisphere_sample();
+  Ray shadow = Ray(hit_p + EPS_D * wi, wi, radius);
+  return bvh->intersect(shadow) ? Spectrum() : Spectrum(1., 1., 1.);
+}
+
+// Surface Path Integrator //
+
+template <bool kIndirect, DirectLightingStrategy kStrategy>
+Spectrum SurfacePathIntegrator<kIndirect, kStrategy>::direct_lighting(
+    const Vector3D& hit_p, const Vector3D& w_out, const Matrix3x3& o2w,
+    BSDF* bsdf) {
+  Spectrum L_out;
+  if (kStrategy == kHemisphereSampling) {
+    // as many samples as sampling the area lights would take
+    size_t num_samples = lights.size() * ns_area_light;
+    for (size_t j = 0; j < num_samples; j++) {
+      Vector3D w_in = uniform_hemisphere_sample();
+      Vector3D wi = o2w * w_in;
+      Ray ray = Ray(hit_p + EPS_D * wi, wi);
+      Intersection isect;
+      if (!bvh->intersect(ray, &isect)) continue;
+      L_out += isect.bsdf->get_emission() * bsdf->f(w_out, w_in) *
+               cos_theta(w_in) * (2. * PI / num_samples);
+    }
+    return L_out;
+  }
+
+  Matrix3x3 w2o = o2w.T();
+  for (SceneLight* light : lights) {
+    size_t num_samples =
+      kStrategy == kDeltaLightSampling || light->is_delta_light() ? 1 : ns_area_light;
+    for (size_t j = 0; j < num_samples; j++) {
+      Vector3D wi;
+      float dist, pdf;
+      Spectrum radiance_in = light->sample_L(hit_p, &wi, &dist, &pdf);
+      Vector3D w_in = w2o * wi;
+      if (cos_theta(w_in) <= 0 || pdf <= 0) continue;
+
+      Ray shadow = Ray(hit_p + EPS_D * wi, wi, double(dist));
+      if (bvh->intersect(shadow)) continue;
+      L_out += radiance_in * bsdf->f(w_out, w_in) * cos_theta(w_in) /
+               (pdf * num_samples);
+    }
+  }
+  return L_out;
+}
+
+template <bool kIndirect, DirectLightingStrategy kStrategy>
+Spectrum SurfacePathIntegrator<kIndirect, kStrategy>::radiance(
+    Ray& r, RadianceComponents* components) {
+  PrimaryHit primary;
+  primary.hit = bvh->intersect(r, &primary.isect);
+  return radiance(r, primary, components);
+}
+
+template <bool kIndirect, DirectLightingStrategy kStrategy>
+Spectrum SurfacePathIntegrator<kIndirect, kStrategy>::radiance(
+    Ray& r, const PrimaryHit& primary, RadianceComponents* components) {
+  Spectrum L_out, throughput(1., 1., 1.);
+  if (!primary.hit) return L_out;
+
+  Ray ray = r;
+  Intersection isect = primary.isect;
+  bool count_emission = true;
+  CacheRecord records[kMaxCacheRecords];
+  size_t num_records = 0;
+
+  // like the volumetric path tracer, a path gathers light at r.depth
+  // vertices at most
+  for (size_t bounce = 0; ; bounce++) {
+    // direct lighting already counted the emission seen after a
+    // non-delta bounce
+    if (count_emission) {
+      Spectrum L_emitted = throughput * isect.bsdf->get_emission();
+      L_out += L_emitted;
+      if (components) (bounce ? components->indirect : components->emission) += L_emitted;
+    }
+
+    Matrix3x3 o2w;
+    make_coord_space(o2w, isect.n);
+    Vector3D hit_p = ray.o + ray.d * isect.t;
+    Vector3D w_out = o2w.T() * (-ray.d);
+
+    if (!isect.bsdf->is_delta()) {
+      Spectrum L_direct = throughput * direct_lighting(hit_p, w_out, o2w, isect.bsdf);
+      L_out += L_direct;
+      if (components) (bounce ? components->indirect : components->direct) += L_direct;
+    }
+    if (!kIndirect || bounce + 1 >= r.depth) break;
+
+    // past the first vertex, take the indirect light from the cache if it
+    // knows it
+    bool diffuse = cache && isect.bsdf->is_diffuse();
+    Spectrum E;
+    if (diffuse && bounce && cache->lookup(hit_p, isect.n, &E)) {
+      Spectrum L_cached = throughput * isect.bsdf->f(w_out, w_out) * E;
+      L_out += L_cached;
+      if (components) components->indirect += L_cached;
+      break;
+    }
+
+    Vector3D w_in;
+    float pdf;
+    Spectrum f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+    if (pdf <= 0) break;
+    throughput *= f * abs_cos_theta(w_in) / pdf;
+
+    // Russian roulette on dim paths only, so bright ones keep their weight
+    double illum = throughput.illum();
+    if (illum < kRouletteThreshold) {
+      double survival = illum / kRouletteThreshold;
+      if (!coin_flip(survival)) break;
+      throughput *= 1. / survival;
+    }
+
+    // the rest of the path estimates the radiance arriving along w_in,
+    // times throughput, and that radiance times cos / pdf the irradiance
+    if (diffuse && num_records < kMaxCacheRecords && w_in.z != 0) {
+      CacheRecord& record = records[num_records++];
+      record.p = hit_p;
+      record.n = isect.n;
+      record.L_before = L_out;
+      record.scale = throughput * (pdf / abs_cos_theta(w_in));
+    }
+
+    Vector3D wi = o2w * w_in;
+    ray = Ray(hit_p + EPS_D * wi, wi, INF_D, ray.depth - 1);
+    count_emission = isect.bsdf->is_delta();
+    if (!bvh->intersect(ray, &isect)) break;
+  }
+
+  for (size_t i = 0; i < num_records; i++) {
+    const CacheRecord& record = records[i];
+    Spectrum L_after = L_out - record.L_before;
+    cache->record(record.p, record.n, Spectrum(
+      record.scale.r > 0 ? L_after.r / record.scale.r : 0.,
+      record.scale.g > 0 ? L_after.g / record.scale.g : 0.,
+      record.scale.b > 0 ? L_after.b / record.scale.b : 0.));
+  }
+  return L_out;
+}
+
+// Volumetric Path Integrator //
+
+template <DirectLightingStrategy kStrategy>
+Spectrum VolumetricPathIntegrator<kStrategy>::radiance(
+    Ray& r, RadianceComponents* components) {
+  return pathtracer->est_radiance_global_illumination<kStrategy>(r, NULL, components);
+}
+
+template <DirectLightingStrategy kStrategy>
+Spectrum VolumetricPathIntegrator<kStrategy>::radiance(
+    Ray& r, const PrimaryHit& primary, RadianceComponents* components) {
+  return pathtracer->est_radiance_global_illumination<kStrategy>(r, &primary, components);
+}
+
+namespace {
+
+template <DirectLightingStrategy kStrategy>
+Integrator* create_lighting_integrator(const std::string& name,
+                                       PathTracer* pathtracer, BVHAccel* bvh,
+                                       const std::vector<SceneLight*>& lights,
+                                       size_t ns_area_light,
+                                       IrradianceCache* cache) {
+  if (name == "direct")
+    return new SurfacePathIntegrator<false, kStrategy>(bvh, lights, ns_area_light);
+  if (name == "path") {
+    return new SurfacePathIntegrator<true, kStrategy>(bvh, lights, ns_area_light,
+                                                      cache);
+  }
+  if (name == "volpath") return new VolumetricPathIntegrator<kStrategy>(pathtracer);
+  return NULL;
+}
+
+} // namespace
+
+Integrator* create_integrator(const std::string& name, PathTracer* pathtracer) {
+  BVHAccel* bvh = pathtracer->bvh;
+  const std::vector<SceneLight*>& lights = pathtracer->scene->lights;
+  size_t ns_area_light = pathtracer->ns_area_light;
+  IrradianceCache* cache = pathtracer->irradianceCache;
+  // only the surface path integrator reads and fills the irradiance cache
+  if (cache && (name == "ao" || name == "direct" || name == "volpath")) {
+    fprintf(stdout, "[PathTracer] The irradiance cache works with -I path only, ignoring it for %s\n",
+            name.c_str());
+  }
+  if (name == "ao") {
+    // occluders up to a tenth of the scene size away
+    return new AmbientOcclusionIntegrator(bvh, .1 * bvh->get_bbox().extent.norm());
+  }
+
+  if (pathtracer->direct_hemisphere_sample) {
+    return create_lighting_integrator<kHemisphereSampling>(
+      name, pathtracer, bvh, lights, ns_area_light, cache);
+  }
+  bool delta_lights_only = true;
+  for (SceneLight* light : lights)
+    delta_lights_only = delta_lights_only && light->is_delta_light();
+  if (delta_lights_only) {
+    return create_lighting_integrator<kDeltaLightSampling>(
+      name, pathtracer, bvh, lights, ns_area_light, cache);
+  }
+  return create_lighting_integrator<kLightSampling>(
+    name, pathtracer, bvh, lights, ns_area_light, cache);
+}
+
+} // namespace CGL
@@ -0,0 +1,159 @@
+#ifndef CGL_INTEGRATOR_H
+#define CGL_INTEGRATOR_H
+
+#include <string>
+#include <vector>
+
+#include "CGL/spectrum.h"
+#include "ray.h"
+#include "bvh.h"
+#include "static_scene/scene.h"
+#include "primary_hit_cache.h"
+#include "irradiance_cache.h"
+
+namespace CGL {
+
+class PathTracer;
+
+/**
+ * How integrators estimate the light arriving straight from the lights:
+ * by sampling the hemisphere uniformly, by sampling the lights, or by
+ * sampling the lights of a scene that has only delta lights.
+ */
+enum DirectLightingStrategy {
+  kHemisphereSampling,
+  kLightSampling,
+  kDeltaLightSampling
+};
+
+/**
+ * The parts of a radiance estimate, by what happens at the first vertex of
+ * its paths: light emitted by the surface the camera sees, light reaching
+ * that surface straight from the lights, light reaching it over more
+ * bounces, and light the media in front of it scatter towards the camera.
+ * They sum to the estimate.
+ */
+struct RadianceComponents {
+  Spectrum emission;
+  Spectrum direct;
+  Spectrum indirect;
+  Spectrum volume;
+};
+
+/**
+ * Interface for integrators, which estimate the radiance arriving along a
+ * camera ray. Each integrator is its own class with its own inner loop, so
+ * the features it leaves out cost nothing: choosing one is the only
+ * decision made at run time, once per camera ray. The integrators are
+ * further compiled for each DirectLightingStrategy, which create_integrator
+ * picks once for the scene.
+ */
+class Integrator {
+ public:
+
+  /**
+   * Virtual destructor.
+   */
+  virtual ~Integrator() { }
+
+  /**
+   * Estimate the radiance arriving at the origin of r from its direction.
+   * r.depth holds the maximum number of bounces. Unless components is
+   * NULL, the estimate is also split up and added to it; integrators that
+   * do not trace light leave it alone.
+   */
+  virtual Spectrum radiance(Ray& r, RadianceComponents* components) = 0;
+
+  /**
+   * Same as radiance(r, components), for a ray whose first hit is already
+   * known. r.max_t already ends at the hit.
+   */
+  virtual Spectrum radiance(Ray& r, const PrimaryHit& primary,
+                            RadianceComponents* components) = 0;
+
+};
+
+/**
+ * Ambient occlusion: the fraction of the hemisphere around the first hit,
+ * weighted by cosine, that is open within radius.
+ */
+class AmbientOcclusionIntegrator : public Integrator {
+ public:
+
+  AmbientOcclusionIntegrator(StaticScene::BVHAccel* bvh, double radius)
+    : bvh(bvh), radius(radius) { }
+
+  Spectrum radiance(Ray& r, RadianceComponents* components);
+  Spectrum radiance(Ray& r, const PrimaryHit& primary,
+                    RadianceComponents* components);
+
+ private:
+  StaticScene::BVHAccel* bvh;
+  double radius;
+};
+
+/**
+ * Path tracing of the surfaces alone, ignoring all media, with direct
+ * lighting estimated at every vertex. Without kIndirect, paths end at the
+ * first hit and the integrator computes direct lighting only.
+ *
+ * With an irradiance cache, paths record the indirect irradiance at their
+ * diffuse vertices, and end at diffuse vertices after the first where the
+ * cache already knows it. This biases the image a little, but saves most
+ * of the bounces of long paths.
+ */
+template <bool kIndirect, DirectLightingStrategy kStrategy>
+class SurfacePathIntegrator : public Integrator {
+ public:
+
+  SurfacePathIntegrator(StaticScene::BVHAccel* bvh,
+                        const std::vector<StaticScene::SceneLight*>& lights,
+                        size_t ns_area_light, IrradianceCache* cache = NULL)
+    : bvh(bvh), lights(lights), ns_area_light(ns_area_light), cache(cache) { }
+
+  Spectrum radiance(Ray& r, RadianceComponents* components);
+  Spectrum radiance(Ray& r, const PrimaryHit& primary,
+                    RadianceComponents* components);
+
+ private:
+
+  /**
+   * Estimate the light reflected at hit_p towards w_out straight from the
+   * lights.
+   */
+  Spectrum direct_lighting(const Vector3D& hit_p, const Vector3D& w_out,
+                           const Matrix3x3& o2w, BSDF* bsdf);
+
+  StaticScene::BVHAccel* bvh;
+  const std::vector<StaticScene::SceneLight*>& lights;
+  size_t ns_area_light;
+  IrradianceCache* cache;
+};
+
+/**
+ * The full volumetric path tracer of PathTracer.
+ */
+template <DirectLightingStrategy kStrategy>
+class VolumetricPathIntegrator : public Integrator {
+ public:
+
+  VolumetricPathIntegrator(PathTracer* pathtracer) : pathtracer(pathtracer) { }
+
+  Spectrum radiance(Ray& r, RadianceComponents* components);
+  Spectrum radiance(Ray& r, const PrimaryHit& primary,
+                    RadianceComponents* components);
+
+ private:
+  PathTracer* pathtracer;
+};
+
+/**
+ * Create the integrator called name for the scene of pathtracer: ao,
+ * direct, path or volpath, compiled for the scene's lights and the direct
+ * lighting strategy pathtracer asks for. Returns NULL for other names.
+ */
+Integrator* create_integrator(const std::string& name, PathTracer* pathtracer);
+
+} // namespace CGL
+
+#endif // CGL_INTEGRATOR_H
@@ -0,0 +1,78 @@
+#include "interface_medium.h"
+
+#include <algorithm>
+
+#include "CGL/misc.h"
+
+namespace CGL {
+
+using StaticScene::Intersection;
+using StaticScene::Primitive;
+
+InterfaceMedium::InterfaceMedium(const std::vector<Primitive*>& boundaries)
+  : maxExtinction(0.) {
+  bvh = new StaticScene::BVHAccel(boundaries);
+  for (const Primitive* p : boundaries)
+    maxExtinction = std::max(maxExtinction, p -> get_medium() -> majorant());
+}
+
+InterfaceMedium::~InterfaceMedium() {
+  delete bvh;
+}
+
+bool InterfaceMedium::next_crossing(const Ray& r, double t, Intersection* isect,
+                                    bool* leaving) const {
+  Ray ray(r.o, r.d);
+  ray.min_t = t + EPS_F;
+  if (!bvh -> intersect(ray, isect)) return false;
+  *leaving = dot(isect -> primitive -> geometric_normal(*isect), r.d) > 0.;
+  return true;
+}
+
+bool InterfaceMedium::next_region(const Ray& r, double t, double max_t,
+                                  MediumRegion* region) const {
+  if (t >= max_t) return false;
+  Intersection isect;
+  bool leaving;
+  if (!next_crossing(r, t, &isect, &leaving)) return false;
+  region -> medium = isect.primitive -> get_medium();
+  if (leaving) {
+    // r is inside from t on
+    region -> t0 = t;
+    region -> t1 = std::min(isect.t, max_t);
+    return true;
+  }
+  if (isect.t >= max_t) return false;
+  region -> t0 = isect.t;
+  region -> t1 = max_t;
+  Intersection exit;
+  if (next_crossing(r, isect.t, &exit, &leaving))
+    region -> t1 = std::min(exit.t, max_t);
+  return true;
+}
+
+const Medium* InterfaceMedium::locate(const Vector3D& p) const {
+  // a direction unlikely to graze the axis-aligned faces of a scene
+  static const Vector3D d = Vector3D(.267, .535, .802).unit();
+  Intersection isect;
+  bool leaving;
+  if (!next_crossing(Ray(p, d), 0., &isect, &leaving) || !leaving) return NULL;
+  return isect.primitive -> get_medium();
+}
+
+double InterfaceMedium::extinction(const Vector3D& p) const {
+  const Medium* medium = locate(p);
+  return medium ? medium -> extinction(p) : 0.;
+}
+
+double InterfaceMedium::scattering(const Vector3D& p) const {
+  const Medium* medium = locate(p);
+  return medium ? medium -> scattering(p) : 0.;
+}
+
+Spectrum InterfaceMedium::phase(const Vector3D& p) const {
+  const Medium* medium = locate(p);
+  return medium ? medium -> phase(p) : Spectrum();
+}
+
+} // namespace CGL
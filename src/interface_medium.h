@@ -0,0 +1,58 @@
+#ifndef CGL_INTERFACEMEDIUM_H
+#define CGL_INTERFACEMEDIUM_H
+
+#include <vector>
+
+#include "medium.h"
+#include "bvh.h"
+
+namespace CGL {
+
+/**
+ * The media filling the objects of a scene, in otherwise empty space. The
+ * surfaces of the objects bound their media and are kept in a BVH of their
+ * own, so a ray finds the regions it passes through by tracing it against
+ * them: leaving a surface through its outward normal means the ray was
+ * inside. The objects must be closed and must not overlap.
+ */
+class InterfaceMedium : public Medium {
+ public:
+
+  /**
+   * Constructor.
+   * \param boundaries the primitives bounding the media, each giving the
+   *        medium on the inside of its normal
+   */
+  InterfaceMedium(const std::vector<StaticScene::Primitive*>& boundaries);
+
+  ~InterfaceMedium();
+
+  double extinction(const Vector3D& p) const;
+  double scattering(const Vector3D& p) const;
+  Spectrum phase(const Vector3D& p) const;
+  double majorant() const { return maxExtinction; }
+
+  bool next_region(const Ray& r, double t, double max_t,
+                   MediumRegion* region) const;
+
+ private:
+
+  /**
+   * Find the first boundary r crosses after t, within [t, INF), and whether
+   * it leaves the medium of the boundary. Returns false if there is none.
+   */
+  bool next_crossing(const Ray& r, double t, StaticScene::Intersection* isect,
+                     bool* leaving) const;
+
+  /**
+   * Get the medium p lies in, NULL if it is in empty space.
+   */
+  const Medium* locate(const Vector3D& p) const;
+
+  StaticScene::BVHAccel* bvh;
+  double maxExtinction;
+};
+
+} // namespace CGL
+
+#endif // CGL_INTERFACEMEDIUM_H
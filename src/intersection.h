@@ -9,6 +9,7 @@
 
 #include "bsdf.h"
 #include "phase.h"
+#include "medium.h"
 
 namespace CGL { namespace StaticScene {
 
@@ -32,14 +33,32 @@ struct Intersection {
 
 struct Interaction {
 
-  Interaction() : t (INF_D), interacted(false) { }
-  Interaction(Phase* phase) : t(INF_D), interacted(false), phase(phase) { }
-  // ~Interaction() {delete phase;}
+  Interaction() : t (INF_D), interacted(false), mediumPhase(NULL), medium(NULL) { }
+
+  /**
+   * Scatter by the phase function of medium at p: its own, or the Schlick
+   * phase function it gives there, which is held in schlick.
+   */
+  void set_phase(const Medium* medium, const Vector3D& p) {
+    mediumPhase = medium -> phase_function();
+    if (!mediumPhase) schlick = SchlickPhase(medium -> phase(p));
+  }
+
+  /**
+   * Get the phase function at the interaction. It is looked up on each
+   * call rather than kept as a pointer into this, so that copies of the
+   * interaction point at their own Schlick phase.
+   */
+  const Phase* phase() const {
+    return mediumPhase ? mediumPhase : &schlick;
+  }
 
   double t;
   bool interacted;
   Vector3D n; // incoming ray direction
-  Phase* phase;
+  const Phase* mediumPhase; ///< the medium's own phase function, NULL if none
+  SchlickPhase schlick; ///< storage for a Schlick phase, so none is allocated
+  const Medium* medium; ///< medium the interaction is in
 
   // More to follow.
 };
@@ -0,0 +1,119 @@
+#include "irradiance_cache.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "random_util.h"
+
+namespace CGL {
+
+namespace {
+
+// Records are summed as integers in units of 2^-16, after clamping, like
+// those of RadianceCache.
+const double kFixedPointScale = 65536.;
+const double kMaxRecord = 1e6;
+
+// Number of records a cell needs before lookups use it.
+const uint32_t kMinRecords = 16;
+
+// Share of the interpolation weight the cells in use must cover.
+const double kMinWeight = .5;
+
+// Entries tried after the one a key hashes to before giving up.
+const size_t kMaxProbes = 8;
+
+} // namespace
+
+IrradianceCache::IrradianceCache(size_t log2_size) {
+  mask = (size_t(1) << log2_size) - 1;
+  entries = new Entry[mask + 1];
+  reset(BBox(Vector3D(0, 0, 0), Vector3D(1, 1, 1)));
+}
+
+IrradianceCache::~IrradianceCache() {
+  delete[] entries;
+}
+
+void IrradianceCache::reset(const BBox& bounds, size_t resolution) {
+  double extent = std::max(bounds.extent.x, std::max(bounds.extent.y, bounds.extent.z));
+  origin = bounds.min;
+  inv_cell_size = extent > 0 ? resolution / extent : 1.;
+  for (size_t i = 0; i <= mask; i++) {
+    entries[i].key = 0;
+    for (int c = 0; c < 3; c++) entries[i].sum[c] = 0;
+    entries[i].count = 0;
+  }
+}
+
+uint64_t IrradianceCache::cell_key(int64_t x, int64_t y, int64_t z,
+                                   const Vector3D& n) const {
+  // the axis n is closest to, and its sign
+  Vector3D a(fabs(n.x), fabs(n.y), fabs(n.z));
+  int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+  uint64_t direction = 2 * axis + (n[axis] < 0);
+  return ((uint64_t(x) & 0xfffff) | (uint64_t(y) & 0xfffff) << 20 |
+          (uint64_t(z) & 0xfffff) << 40 | direction << 60) + 1;
+}
+
+IrradianceCache::Entry* IrradianceCache::find(uint64_t key, bool claim) const {
+  size_t index = hash_uint64(key);
+  for (size_t i = 0; i <= kMaxProbes; i++) {
+    Entry& e = entries[(index + i) & mask];
+    uint64_t found = e.key.load(std::memory_order_acquire);
+    if (found == key) return &e;
+    if (found) continue;
+    if (!claim) return NULL;
+    // another thread may claim the entry first, possibly for this key
+    if (e.key.compare_exchange_strong(found, key, std::memory_order_acq_rel) ||
+        found == key)
+      return &e;
+  }
+  return NULL;
+}
+
+void IrradianceCache::record(const Vector3D& p, const Vector3D& n,
+                             const Spectrum& irradiance) {
+  Vector3D q = (p - origin) * inv_cell_size;
+  Entry* e = find(cell_key(int64_t(floor(q.x)), int64_t(floor(q.y)),
+                           int64_t(floor(q.z)), n), true);
+  if (!e) return;
+  const float rgb[3] = {irradiance.r, irradiance.g, irradiance.b};
+  for (int c = 0; c < 3; c++) {
+    double v = std::min(std::max(double(rgb[c]), 0.), kMaxRecord);
+    e->sum[c].fetch_add(uint64_t(v * kFixedPointScale), std::memory_order_relaxed);
+  }
+  e->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool IrradianceCache::lookup(const Vector3D& p, const Vector3D& n,
+                             Spectrum* irradiance) const {
+  // offset by half a cell, so that q lies between the centers of the
+  // cells it interpolates
+  Vector3D q = (p - origin) * inv_cell_size - Vector3D(.5, .5, .5);
+  int64_t x0 = int64_t(floor(q.x)), y0 = int64_t(floor(q.y)), z0 = int64_t(floor(q.z));
+  Vector3D t = q - Vector3D(x0, y0, z0);
+
+  double sum[3] = {0., 0., 0.};
+  double weight_sum = 0.;
+  for (int corner = 0; corner < 8; corner++) {
+    int dx = corner & 1, dy = corner >> 1 & 1, dz = corner >> 2;
+    double weight = (dx ? t.x : 1. - t.x) * (dy ? t.y : 1. - t.y) *
+                    (dz ? t.z : 1. - t.z);
+    if (weight <= 0) continue;
+    Entry* e = find(cell_key(x0 + dx, y0 + dy, z0 + dz, n), false);
+    if (!e) continue;
+    uint32_t count = e->count.load(std::memory_order_relaxed);
+    if (count < kMinRecords) continue;
+    for (int c = 0; c < 3; c++)
+      sum[c] += weight * e->sum[c].load(std::memory_order_relaxed) / count;
+    weight_sum += weight;
+  }
+  if (weight_sum < kMinWeight) return false;
+
+  double scale = 1. / (kFixedPointScale * weight_sum);
+  *irradiance = Spectrum(sum[0] * scale, sum[1] * scale, sum[2] * scale);
+  return true;
+}
+
+} // namespace CGL
@@ -0,0 +1,74 @@
+#ifndef CGL_IRRADIANCECACHE_H
+#define CGL_IRRADIANCECACHE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "CGL/vector3D.h"
+#include "CGL/spectrum.h"
+#include "bbox.h"
+
+namespace CGL {
+
+/**
+ * A world-space cache of the indirect irradiance on diffuse surfaces,
+ * stored in a lock-free hash table of grid cells. Each cell keeps apart
+ * the surfaces facing along each of the six axis directions. Unlike
+ * RadianceCache, records are visible to lookups as soon as they are added,
+ * so the cache fills while the first pass renders. Lookups interpolate
+ * trilinearly between the cells around a point, so the irradiance varies
+ * smoothly instead of in steps.
+ */
+class IrradianceCache {
+ public:
+
+  /**
+   * Constructor.
+   * \param log2_size log2 of the number of hash table entries
+   */
+  IrradianceCache(size_t log2_size = 18);
+
+  ~IrradianceCache();
+
+  /**
+   * Forget everything and cover bounds with cells of about
+   * 1 / resolution of its largest extent.
+   */
+  void reset(const BBox& bounds, size_t resolution = 32);
+
+  /**
+   * Add an irradiance estimate at p, on a surface facing n. Safe to call
+   * from several threads, also while others call lookup().
+   */
+  void record(const Vector3D& p, const Vector3D& n, const Spectrum& irradiance);
+
+  /**
+   * Get the cached irradiance at p on a surface facing n. Returns false
+   * if the cells around p do not have enough records yet.
+   */
+  bool lookup(const Vector3D& p, const Vector3D& n, Spectrum* irradiance) const;
+
+ private:
+  struct Entry {
+    std::atomic<uint64_t> key;     ///< cell and direction + 1, 0 if free
+    std::atomic<uint64_t> sum[3];  ///< sum of the records in fixed point
+    std::atomic<uint32_t> count;   ///< number of records
+  };
+
+  uint64_t cell_key(int64_t x, int64_t y, int64_t z, const Vector3D& n) const;
+
+  /**
+   * Find the entry of key, or claim a free one for it if claim is set.
+   * Returns NULL if there is neither.
+   */
+  Entry* find(uint64_t key, bool claim) const;
+
+  Entry* entries;
+  size_t mask;           ///< number of entries - 1
+  Vector3D origin;       ///< corner of the grid
+  double inv_cell_size;  ///< cells per unit length
+};
+
+} // namespace CGL
+
+#endif // CGL_IRRADIANCECACHE_H
@@ -0,0 +1,173 @@
+#include "macrocell_grid.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "CGL/misc.h"
+
+namespace CGL {
+
+MacrocellGrid::MacrocellGrid(const Matrix4x4& cell_to_world, const Vector3D& extent)
+  : extent(extent), minAll(INF_D), maxAll(0.) {
+  for (int a = 0; a < 3; a++)
+    n[a] = std::max(size_t(1), size_t(ceil(extent[a])));
+  Matrix4x4 m = cell_to_world.inv();
+  for (int a = 0; a < 3; a++)
+    world_to_cell[a] = Vector3D(m(a, 0), m(a, 1), m(a, 2));
+  cell_offset = Vector3D(m(0, 3), m(1, 3), m(2, 3));
+  Cell empty = {0.f, 0.f};
+  cells.assign(n[0] * n[1] * n[2], empty);
+  outside = empty;
+}
+
+void MacrocellGrid::set(size_t i, size_t j, size_t k,
+                        double min_extinction, double max_extinction) {
+  Cell& c = cells[i + n[0] * (j + n[1] * k)];
+  c.min_extinction = min_extinction;
+  c.max_extinction = max_extinction;
+  minAll = std::min(minAll, min_extinction);
+  maxAll = std::max(maxAll, max_extinction);
+}
+
+void MacrocellGrid::set_outside(double min_extinction, double max_extinction) {
+  outside.min_extinction = min_extinction;
+  outside.max_extinction = max_extinction;
+}
+
+MajorantIterator::MajorantIterator(const Medium* medium, const Ray& r, double max_t)
+  : medium(medium), r(r), max_t(max_t), stage(DONE) {
+  region.t1 = 0.;
+}
+
+void MajorantIterator::start_region(const MediumRegion& region) {
+  this->region = region;
+  grid = region.medium -> macrocells();
+  stage = BEFORE;
+  t = region.t0;
+  t_far = region.t1;
+  if (!grid) {
+    // a single segment, as if the ray never reached a grid
+    t_enter = t_exit = region.t1;
+    min_outside = region.medium -> minorant();
+    max_outside = region.medium -> majorant();
+    return;
+  }
+  min_outside = grid -> outside.min_extinction;
+  max_outside = grid -> outside.max_extinction;
+
+  Vector3D o(dot(grid -> world_to_cell[0], r.o), dot(grid -> world_to_cell[1], r.o),
+             dot(grid -> world_to_cell[2], r.o));
+  o += grid -> cell_offset;
+  Vector3D d(dot(grid -> world_to_cell[0], r.d), dot(grid -> world_to_cell[1], r.d),
+             dot(grid -> world_to_cell[2], r.d));
+
+  // clip the region to the box, and find where the ray leaves the last of
+  // its slabs
+  t_enter = region.t0;
+  t_exit = region.t1;
+  double t_slabs = region.t0;
+  for (int a = 0; a < 3; a++) {
+    if (d[a] == 0.) {
+      if (o[a] < 0. || o[a] > grid -> extent[a]) t_exit = -1.;
+      continue;
+    }
+    double t0 = - o[a] / d[a], t1 = (grid -> extent[a] - o[a]) / d[a];
+    t_enter = std::max(t_enter, std::min(t0, t1));
+    t_exit = std::min(t_exit, std::max(t0, t1));
+    t_slabs = std::max(t_slabs, std::max(t0, t1));
+  }
+  if (region.t1 == INF_D) {
+    // the extinction no longer changes along the ray past the slabs
+    t_far = t_slabs;
+    far_extinction = region.medium -> extinction(r.o + r.d * (t_far + 1.));
+  }
+  if (!(t_enter < t_exit)) {
+    // missing the box, the ray is outside it from the start
+    t_enter = t_exit = region.t0;
+    return;
+  }
+
+  Vector3D p = o + d * t_enter;
+  for (int a = 0; a < 3; a++) {
+    int last = int(grid -> n[a]) - 1;
+    cell[a] = std::min(std::max(int(floor(p[a])), 0), last);
+    if (d[a] > 0.) {
+      step[a] = 1;
+      t_next[a] = (cell[a] + 1 - o[a]) / d[a];
+      t_delta[a] = 1. / d[a];
+    } else if (d[a] < 0.) {
+      step[a] = -1;
+      t_next[a] = (cell[a] - o[a]) / d[a];
+      t_delta[a] = -1. / d[a];
+    } else {
+      step[a] = 0;
+      t_next[a] = INF_D;
+      t_delta[a] = INF_D;
+    }
+  }
+}
+
+bool MajorantIterator::next(MajorantSegment* segment) {
+  while (true) {
+    segment -> medium = region.medium;
+    switch (stage) {
+      case BEFORE:
+        stage = t_enter < t_exit ? INSIDE : AFTER;
+        if (t_enter > t) {
+          segment -> t0 = t;
+          segment -> t1 = t = t_enter;
+          segment -> min_extinction = min_outside;
+          segment -> max_extinction = max_outside;
+          return true;
+        }
+        break;
+      case INSIDE: {
+        int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2)
+                                      : (t_next[1] < t_next[2] ? 1 : 2);
+        const MacrocellGrid::Cell& c =
+          grid -> cells[cell[0] + grid -> n[0] * (cell[1] + grid -> n[1] * cell[2])];
+        segment -> t0 = t;
+        segment -> min_extinction = c.min_extinction;
+        segment -> max_extinction = c.max_extinction;
+        t = std::min(t_next[a], t_exit);
+        cell[a] += step[a];
+        t_next[a] += t_delta[a];
+        // rounding may step out of the grid just short of the exit
+        if (t >= t_exit || cell[a] < 0 || cell[a] >= int(grid -> n[a])) {
+          stage = AFTER;
+          t = t_exit;
+        }
+        segment -> t1 = t;
+        return true;
+      }
+      case AFTER:
+        stage = FAR;
+        if (t < t_far) {
+          segment -> t0 = t;
+          segment -> t1 = t = t_far;
+          segment -> min_extinction = min_outside;
+          segment -> max_extinction = max_outside;
+          return true;
+        }
+        break;
+      case FAR:
+        stage = DONE;
+        if (t < region.t1) {
+          segment -> t0 = t;
+          segment -> t1 = region.t1;
+          segment -> min_extinction = far_extinction;
+          segment -> max_extinction = far_extinction;
+          return true;
+        }
+        break;
+      case DONE: {
+        MediumRegion next;
+        if (!medium -> next_region(r, region.t1, max_t, &next)) return false;
+        start_region(next);
+        break;
+      }
+    }
+  }
+}
+
+} // namespace CGL
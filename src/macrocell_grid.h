@@ -0,0 +1,137 @@
+#ifndef CGL_MACROCELLGRID_H
+#define CGL_MACROCELLGRID_H
+
+#include <vector>
+#include <algorithm>
+
+#include "CGL/vector3D.h"
+#include "CGL/matrix4x4.h"
+#include "ray.h"
+#include "medium.h"
+
+namespace CGL {
+
+/**
+ * A stretch [t0, t1) of a ray within medium over which its extinction
+ * stays between min_extinction and max_extinction.
+ */
+struct MajorantSegment {
+  double t0, t1;
+  double min_extinction, max_extinction;
+  const Medium* medium;
+};
+
+/**
+ * A coarse grid over a medium storing the smallest and largest extinction
+ * in each of its cells, and outside the box it covers. Tracking along a
+ * ray walks the cells it crosses, taking their bounds as local majorants
+ * and control extinctions, and skips empty cells. Once a ray has left the
+ * box's slab along every axis it moves along, the medium's extinction must
+ * stay constant on it, as it does for media that are empty, uniform or
+ * clamped to their boundary outside the box.
+ */
+class MacrocellGrid {
+ public:
+
+  /**
+   * Constructor. Cell (i, j, k) spans [i, i + 1] x [j, j + 1] x [k, k + 1]
+   * in cell coordinates, and the grid covers [0, extent] of them, so the
+   * last cell along an axis may be cut short. All bounds start at 0.
+   * \param cell_to_world transform from cell to world coordinates
+   * \param extent the extent of the box covered, in cells
+   */
+  MacrocellGrid(const Matrix4x4& cell_to_world, const Vector3D& extent);
+
+  /**
+   * Get the number of cells along axis a.
+   */
+  size_t size(int a) const { return n[a]; }
+
+  /**
+   * Set the bounds of the extinction within cell (i, j, k).
+   */
+  void set(size_t i, size_t j, size_t k, double min_extinction, double max_extinction);
+
+  /**
+   * Set the bounds of the extinction outside the box.
+   */
+  void set_outside(double min_extinction, double max_extinction);
+
+  /**
+   * Get the bounds of the extinction everywhere.
+   */
+  double min_extinction() const {
+    return std::min(minAll, double(outside.min_extinction));
+  }
+  double max_extinction() const {
+    return std::max(maxAll, double(outside.max_extinction));
+  }
+
+ private:
+  friend class MajorantIterator;
+
+  struct Cell {
+    float min_extinction, max_extinction;
+  };
+
+  size_t n[3];
+  Vector3D extent;
+  Vector3D world_to_cell[3];  ///< rows of the affine world to cell transform
+  Vector3D cell_offset;       ///< its translation
+  std::vector<Cell> cells;
+  Cell outside;
+  double minAll, maxAll;      ///< bounds over the cells
+};
+
+/**
+ * Splits a ray through a medium into segments with their own bounds of
+ * the extinction. The ray passes through the regions of the medium in
+ * turn, and through each walks the macrocells of the region's medium by
+ * 3D DDA. A medium without macrocells makes a single segment per region,
+ * bounded by its majorant and minorant. A region reaching infinity ends in
+ * a segment of the constant extinction far along the ray, so that tracking
+ * never takes null collisions forever where the medium is empty.
+ */
+class MajorantIterator {
+ public:
+
+  /**
+   * Constructor.
+   * \param medium the medium r passes through
+   * \param r the ray
+   * \param max_t where the segments end
+   */
+  MajorantIterator(const Medium* medium, const Ray& r, double max_t);
+
+  /**
+   * Get the next segment, in order along the ray. Returns false once the
+   * segments reach max_t.
+   */
+  bool next(MajorantSegment* segment);
+
+ private:
+  enum Stage { BEFORE, INSIDE, AFTER, FAR, DONE };
+
+  /**
+   * Start walking the macrocells of region.
+   */
+  void start_region(const MediumRegion& region);
+
+  const Medium* medium;
+  Ray r;
+  double max_t;
+  MediumRegion region;     ///< the region walked
+  const MacrocellGrid* grid;  ///< macrocells of the region's medium, NULL if none
+  Stage stage;
+  double t;
+  double t_enter, t_exit;  ///< where the region is within the grid's box
+  double t_far;            ///< where the ray has left the box's slabs, if the region is infinite
+  double min_outside, max_outside;
+  double far_extinction;   ///< the extinction from t_far on
+  int cell[3], step[3];
+  double t_next[3], t_delta[3];
+};
+
+} // namespace CGL
+
+#endif // CGL_MACROCELLGRID_H
@@ -16,6 +16,7 @@ typedef uint32_t gid_t;
 #include "misc/getopt.h"
 #else
 #include <unistd.h>
+#include <getopt.h>
 #endif
 
 using namespace std;
@@ -31,12 +32,61 @@ void usage(const char* binaryName) {
   printf("  -t  <INT>        Number of render threads\n");
   printf("  -m  <INT>        Maximum ray depth\n");
   printf("  -e  <PATH>       Path to environment map\n");
+  printf("  -E               Save environment map sampling pdf to probability_debug.png\n");
+  printf("  -g  <NAME>       Sample generator: sobol (default), halton, stratified,\n");
+  printf("                   lattice or independent\n");
+  printf("  -S  <INT>        Frame seed; renders with the same seed are identical\n");
+  printf("  -T  <DURATION>   Render time budget, e.g. 90, 120s, 2m or 1h (--time)\n");
+  printf("  -P               Progressive mode: whole-image passes of doubling\n");
+  printf("                   sample count (--progressive)\n");
+  printf("  -i  <DURATION>   Save the image and an .exr copy at this interval\n");
+  printf("                   while rendering (--snapshot)\n");
+  printf("  -A               Drive Russian roulette and splitting by a radiance\n");
+  printf("                   cache learned in earlier passes (--adjoint-rr)\n");
+  printf("  -G               Guide path directions by the incident radiance\n");
+  printf("                   learned in earlier passes (--guiding)\n");
+  printf("  -I  <NAME>       Integrator: volpath (default), path (surfaces only),\n");
+  printf("                   direct or ao (--integrator)\n");
+  printf("  -R  <INT>        Reuse the first hits of camera rays through an n x n\n");
+  printf("                   pattern in each pixel (--reuse-hits)\n");
+  printf("  -D               Denoise the finished render, guided by first-hit\n");
+  printf("                   albedo, normal and depth (--denoise)\n");
+  printf("  -O  <LIST>       Also write these comma-separated AOVs to the .exr:\n");
+  printf("                   emission, direct, indirect, volume, albedo, normal,\n");
+  printf("                   depth, samples or all (--aov)\n");
+  printf("  -C               Cache indirect irradiance on diffuse surfaces for\n");
+  printf("                   the path integrator (--irradiance-cache)\n");
+  printf("  -V  <FILENAME>   Fill the scene with the medium of this Mitsuba .vol\n");
+  printf("                   grid instead of the cloud (--medium)\n");
+  printf("  -B               Store the medium of -V sparsely, in bricks of half\n");
+  printf("                   floats where it is not empty (--bricks)\n");
+  printf("  -X               Estimate shadow ray transmittance by plain ratio\n");
+  printf("                   tracking, without a control extinction\n");
+  printf("                   (--ratio-tracking)\n");
+  printf("  -M  <LIST>       Fill the scene, or the box x0,y0,z0,x1,y1,z1 if\n");
+  printf("                   given, with a homogeneous medium instead of the\n");
+  printf("                   cloud: extinction,scattering[,box], with\n");
+  printf("                   0 <= scattering <= extinction; -V takes\n");
+  printf("                   precedence (--homogeneous)\n");
+  printf("  -K  <INT>        Megabytes the cloud's bricks of noise may take\n");
+  printf("                   (--noise-cache)\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
   printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
   printf("  -h               Print this help message\n");
   printf("\n");
 }
 
+// Parses a duration like "90", "120s", "2m" or "1h" into seconds.
+double parse_duration(const char* str) {
+  char* unit;
+  double t = strtod(str, &unit);
+  switch (*unit) {
+    case 'm': return t * 60.;
+    case 'h': return t * 3600.;
+    default:  return t;
+  }
+}
+
 HDRImageBuffer* load_exr(const char* file_path) {
   
   const char* err;
@@ -83,7 +133,26 @@ int main( int argc, char** argv ) {
   bool write_to_file = false;
   size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
   string filename, cam_settings = "";
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:a:p:b:d:")) != -1 ) {  // for each option...
+  static struct option long_options[] = {
+    {"time",        required_argument, NULL, 'T'},
+    {"progressive", no_argument,       NULL, 'P'},
+    {"snapshot",    required_argument, NULL, 'i'},
+    {"adjoint-rr",  no_argument,       NULL, 'A'},
+    {"guiding",     no_argument,       NULL, 'G'},
+    {"integrator",  required_argument, NULL, 'I'},
+    {"reuse-hits",  required_argument, NULL, 'R'},
+    {"denoise",     no_argument,       NULL, 'D'},
+    {"aov",         required_argument, NULL, 'O'},
+    {"irradiance-cache", no_argument,  NULL, 'C'},
+    {"medium",      required_argument, NULL, 'V'},
+    {"bricks",      no_argument,       NULL, 'B'},
+    {"ratio-tracking", no_argument,    NULL, 'X'},
+    {"homogeneous", required_argument, NULL, 'M'},
+    {"noise-cache", required_argument, NULL, 'K'},
+    {NULL, 0, NULL, 0}
+  };
+  while ( (opt = getopt_long(argc, argv, "s:l:t:m:e:Eg:S:T:Pi:AGI:R:DO:CV:BXM:K:h:H:f:r:c:a:p:b:d:",
+                             long_options, NULL)) != -1 ) {  // for each option...
     switch ( opt ) {
       case 'f':
           write_to_file = true;
@@ -121,6 +190,61 @@ int main( int argc, char** argv ) {
           break;
       case 'e':
           config.pathtracer_envmap = load_exr(optarg);
+          config.pathtracer_envmap_path = string(optarg);
+          break;
+      case 'E':
+          config.pathtracer_envmap_debug = true;
+          break;
+      case 'g':
+          config.pathtracer_sample_generator = string(optarg);
+          break;
+      case 'S':
+          config.pathtracer_seed = strtoul(optarg, NULL, 10);
+          break;
+      case 'T':
+          config.pathtracer_max_render_time = parse_duration(optarg);
+          break;
+      case 'P':
+          config.pathtracer_progressive = true;
+          break;
+      case 'i':
+          config.pathtracer_snapshot_interval = parse_duration(optarg);
+          break;
+      case 'A':
+          config.pathtracer_adjoint_rr = true;
+          break;
+      case 'G':
+          config.pathtracer_guiding = true;
+          break;
+      case 'I':
+          config.pathtracer_integrator = string(optarg);
+          break;
+      case 'R':
+          config.pathtracer_primary_hit_pattern = atoi(optarg);
+          break;
+      case 'D':
+          config.pathtracer_denoise = true;
+          break;
+      case 'O':
+          config.pathtracer_aovs = string(optarg);
+          break;
+      case 'C':
+          config.pathtracer_irradiance_cache = true;
+          break;
+      case 'V':
+          config.pathtracer_medium = string(optarg);
+          break;
+      case 'B':
+          config.pathtracer_medium_bricks = true;
+          break;
+      case 'X':
+          config.pathtracer_ratio_tracking = true;
+          break;
+      case 'M':
+          config.pathtracer_homogeneous_medium = string(optarg);
+          break;
+      case 'K':
+          config.pathtracer_noise_cache = atoi(optarg);
           break;
       case 'c':
           cam_settings = string(optarg);
@@ -0,0 +1,509 @@
+#include "medium.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "half.h"
+#include "macrocell_grid.h"
+#include "bricked_noise.h"
+#include "phase.h"
+
+namespace CGL {
+
+namespace {
+
+// An axis-aligned ellipsoid: the points with
+// sum((p - center)^2 / radius2) < 1.
+struct Ellipsoid {
+  Vector3D center;
+  Vector3D radius2;  ///< squared radii
+};
+
+const Ellipsoid kCloud[] = {
+  {Vector3D(0., 0., -4.), Vector3D(1.5, 0.25, 2.0)},
+  {Vector3D(.85, 0., -4.), Vector3D(0.75, 0.125, 1.0)},
+  {Vector3D(-.8, -.25, -4.), Vector3D(0.75, 0.125, 1.0)},
+};
+
+bool in_ellipsoid(const Ellipsoid& e, const Vector3D& p) {
+  Vector3D d = p - e.center;
+  return d.x * d.x / e.radius2.x + d.y * d.y / e.radius2.y +
+         d.z * d.z / e.radius2.z < 1.;
+}
+
+// Whether p lies in one of the three ellipsoids of cloud.
+bool in_cloud(const Vector3D& p) {
+  return in_ellipsoid(kCloud[0], p) || in_ellipsoid(kCloud[1], p) ||
+         in_ellipsoid(kCloud[2], p);
+}
+
+// Whether some point of box lies in the cloud. Within an axis-aligned
+// ellipsoid's metric the box's point closest to the center is found axis
+// by axis.
+bool box_in_cloud(const BBox& box) {
+  for (const Ellipsoid& e : kCloud) {
+    Vector3D closest;
+    for (int a = 0; a < 3; a++)
+      closest[a] = std::min(std::max(e.center[a], box.min[a]), box.max[a]);
+    if (in_ellipsoid(e, closest)) return true;
+  }
+  return false;
+}
+
+// Edge of the cloud's macrocells.
+const double kCloudCellSize = .25;
+
+// Noise of the cloud's density: 4 octaves of fBm over features about a
+// unit across, sampled every 1/48 unit.
+const double kCloudNoiseFrequency = 1.5;
+const int kCloudNoiseOctaves = 4;
+const double kCloudNoiseSpacing = 1. / 48.;
+
+// Finds the voxel at or below grid coordinate g of an axis of n voxels,
+// clamped to the axis, and adds its offset to base. step is the offset of
+// the next voxel, t the position of g between the two.
+inline void locate_axis(double g, size_t n, size_t stride,
+                        size_t* base, size_t* step, float* t) {
+  if (!(g > 0.)) g = 0.;
+  size_t i = int64_t(g);
+  if (i + 1 >= n) {
+    *base += (n - 1) * stride;
+    *step = 0;
+    *t = 0.f;
+    return;
+  }
+  *base += i * stride;
+  *step = stride;
+  *t = float(g - i);
+}
+
+// Header of a Mitsuba gridvolume file.
+struct VolHeader {
+  int32_t res[3];
+  int32_t channels;
+  float bounds[6];  ///< min and max of the box spanned by the voxel centers
+};
+
+// Reads the header of a .vol file of float32 voxels with 1, 2 or 5
+// channels.
+bool read_vol_header(std::istream& in, VolHeader* header) {
+  char magic[4];
+  int32_t encoding;
+  if (!in.read(magic, 4) || std::memcmp(magic, "VOL\3", 4) ||
+      !in.read((char*) &encoding, 4) || encoding != 1 ||
+      !in.read((char*) header->res, sizeof(header->res)) ||
+      !in.read((char*) &header->channels, 4) ||
+      !in.read((char*) header->bounds, sizeof(header->bounds)))
+    return false;
+  int32_t channels = header->channels;
+  return header->res[0] > 0 && header->res[1] > 0 && header->res[2] > 0 &&
+         (channels == 1 || channels == 2 || channels == 5);
+}
+
+// Transform scaling and translating the voxel centers onto the header's
+// box.
+Matrix4x4 grid_to_world(const VolHeader& header) {
+  Matrix4x4 m = Matrix4x4::identity();
+  for (int a = 0; a < 3; a++) {
+    int32_t n = header.res[a];
+    m(a, a) = n > 1 ? (header.bounds[a + 3] - header.bounds[a]) / (n - 1.) : 1.;
+    m(a, 3) = header.bounds[a];
+  }
+  return m;
+}
+
+// Reads the channels of a voxel, filling in the missing ones.
+void read_voxel(const float* voxel, size_t channels,
+                float* extinction, float* albedo, Spectrum* phase) {
+  *extinction = voxel[0];
+  *albedo = channels >= 2 ? voxel[1] : 1.f;
+  *phase = channels >= 5 ? Spectrum(voxel[2], voxel[3], voxel[4]) : Spectrum();
+}
+
+inline float lerp(float a, float b, float t) {
+  return a + (b - a) * t;
+}
+
+} // namespace
+
+// Medium //
+
+bool Medium::next_region(const Ray& r, double t, double max_t,
+                         MediumRegion* region) const {
+  if (!(t < max_t)) return false;
+  region->t0 = t;
+  region->t1 = max_t;
+  region->medium = this;
+  return true;
+}
+
+// Cloud Medium //
+
+CloudMedium::CloudMedium(size_t noise_cache) {
+  noise = new BrickedNoise(kCloudNoiseFrequency, kCloudNoiseOctaves,
+                           kCloudNoiseSpacing, noise_cache);
+  BBox bounds;
+  for (const Ellipsoid& e : kCloud) {
+    Vector3D r(sqrt(e.radius2.x), sqrt(e.radius2.y), sqrt(e.radius2.z));
+    bounds.expand(e.center - r);
+    bounds.expand(e.center + r);
+  }
+  Matrix4x4 cell_to_world = Matrix4x4::identity();
+  for (int a = 0; a < 3; a++) {
+    cell_to_world(a, a) = kCloudCellSize;
+    cell_to_world(a, 3) = bounds.min[a];
+  }
+  macrocellGrid = new MacrocellGrid(cell_to_world, bounds.extent / kCloudCellSize);
+
+  // the sky is .1 everywhere, the cloud .3 plus noise within .2
+  for (size_t k = 0; k < macrocellGrid->size(2); k++) {
+    for (size_t j = 0; j < macrocellGrid->size(1); j++) {
+      for (size_t i = 0; i < macrocellGrid->size(0); i++) {
+        Vector3D corner = bounds.min + Vector3D(i, j, k) * kCloudCellSize;
+        BBox cell(corner, corner + Vector3D(kCloudCellSize, kCloudCellSize, kCloudCellSize));
+        macrocellGrid->set(i, j, k, minorant(), box_in_cloud(cell) ? majorant() : minorant());
+      }
+    }
+  }
+  macrocellGrid->set_outside(minorant(), minorant());
+}
+
+CloudMedium::~CloudMedium() {
+  delete macrocellGrid;
+  delete noise;
+}
+
+double CloudMedium::extinction(const Vector3D& p) const {
+  return in_cloud(p) ? 0.3 + .2 * noise->lookup(p) : 0.1;
+}
+
+double CloudMedium::scattering(const Vector3D& p) const {
+  return in_cloud(p) ? 0.6 + .2 * noise->lookup(p) : 0.2;
+}
+
+Spectrum CloudMedium::phase(const Vector3D& p) const {
+  return in_cloud(p) ? Spectrum(.5, .5, -.5)   // kumo
+                     : Spectrum(-.5, -.5, .9); // sora
+}
+
+double CloudMedium::majorant() const {
+  return 0.5;
+}
+
+double CloudMedium::minorant() const {
+  // the sky's extinction, which the cloud's never falls below
+  return 0.1;
+}
+
+// Homogeneous Medium //
+
+HomogeneousMedium::HomogeneousMedium(double extinction, double scattering,
+                                     const BBox& bounds)
+  : sigma_t(extinction), sigma_s(scattering), bounds(bounds),
+    macrocellGrid(NULL), phaseFunction(NULL) {
+  if (bounds.empty()) return;
+  Matrix4x4 cell_to_world = Matrix4x4::identity();
+  for (int a = 0; a < 3; a++) {
+    cell_to_world(a, a) = bounds.extent[a];
+    cell_to_world(a, 3) = bounds.min[a];
+  }
+  macrocellGrid = new MacrocellGrid(cell_to_world, Vector3D(1., 1., 1.));
+  macrocellGrid->set(0, 0, 0, sigma_t, sigma_t);
+}
+
+HomogeneousMedium::~HomogeneousMedium() {
+  delete macrocellGrid;
+  delete phaseFunction;
+}
+
+HomogeneousMedium* HomogeneousMedium::parse(const std::string& spec) {
+  std::stringstream in(spec);
+  std::vector<double> values;
+  std::string value;
+  while (getline(in, value, ',')) {
+    char* end;
+    values.push_back(strtod(value.c_str(), &end));
+    if (value.empty() || *end) return NULL;
+  }
+  if (values.size() < 2) return NULL;
+  // the coefficients must be nonnegative, and scattering part of extinction
+  if (!(values[1] >= 0. && values[1] <= values[0])) return NULL;
+  if (values.size() == 2) return new HomogeneousMedium(values[0], values[1]);
+  if (values.size() != 8) return NULL;
+  BBox bounds(Vector3D(values[2], values[3], values[4]));
+  bounds.expand(Vector3D(values[5], values[6], values[7]));
+  if (!(bounds.extent.x > 0. && bounds.extent.y > 0. && bounds.extent.z > 0.))
+    return NULL;
+  return new HomogeneousMedium(values[0], values[1], bounds);
+}
+
+double HomogeneousMedium::extinction(const Vector3D& p) const {
+  if (bounds.empty()) return sigma_t;
+  return p.x >= bounds.min.x && p.y >= bounds.min.y && p.z >= bounds.min.z &&
+         p.x <= bounds.max.x && p.y <= bounds.max.y && p.z <= bounds.max.z
+         ? sigma_t : 0.;
+}
+
+double HomogeneousMedium::scattering(const Vector3D& p) const {
+  return extinction(p) > 0. ? sigma_s : 0.;
+}
+
+// Voxel Medium //
+
+VoxelMedium::VoxelMedium(size_t nx, size_t ny, size_t nz,
+                         const Matrix4x4& grid_to_world)
+  : nx(nx), ny(ny), nz(nz) {
+  Matrix4x4 m = grid_to_world.inv();
+  for (int a = 0; a < 3; a++)
+    world_to_grid[a] = Vector3D(m(a, 0), m(a, 1), m(a, 2));
+  grid_offset = Vector3D(m(0, 3), m(1, 3), m(2, 3));
+  for (int corner = 0; corner < 8; corner++) {
+    Vector4D g((corner & 1) * (nx - 1.), (corner >> 1 & 1) * (ny - 1.),
+               (corner >> 2) * (nz - 1.), 1.);
+    bbox.expand((grid_to_world * g).to3D());
+  }
+
+  Matrix4x4 scale = Matrix4x4::identity();
+  for (int a = 0; a < 3; a++) scale(a, a) = kMacrocellSize;
+  Vector3D extent(nx - 1., ny - 1., nz - 1.);
+  macrocellGrid = new MacrocellGrid(grid_to_world * scale, extent / kMacrocellSize);
+}
+
+VoxelMedium::~VoxelMedium() {
+  delete macrocellGrid;
+}
+
+double VoxelMedium::majorant() const {
+  return macrocellGrid->max_extinction();
+}
+
+double VoxelMedium::minorant() const {
+  return macrocellGrid->min_extinction();
+}
+
+// Grid Medium //
+
+GridMedium::GridMedium(size_t nx, size_t ny, size_t nz,
+                       const Matrix4x4& grid_to_world,
+                       const std::vector<float>& extinction,
+                       const std::vector<float>& albedo,
+                       const std::vector<Spectrum>& phase)
+  : VoxelMedium(nx, ny, nz, grid_to_world),
+    extinctions(extinction), albedos(albedo), phases(phase) {
+  // each macrocell bounds the voxels at and between its corners
+  size_t m = kMacrocellSize;
+  for (size_t ck = 0; ck < macrocellGrid->size(2); ck++) {
+    for (size_t cj = 0; cj < macrocellGrid->size(1); cj++) {
+      for (size_t ci = 0; ci < macrocellGrid->size(0); ci++) {
+        float lo = INF_F, hi = 0.f;
+        for (size_t k = ck * m; k <= std::min((ck + 1) * m, nz - 1); k++) {
+          for (size_t j = cj * m; j <= std::min((cj + 1) * m, ny - 1); j++) {
+            for (size_t i = ci * m; i <= std::min((ci + 1) * m, nx - 1); i++) {
+              float sigma_t = extinctions[i + nx * (j + ny * k)];
+              lo = std::min(lo, sigma_t);
+              hi = std::max(hi, sigma_t);
+            }
+          }
+        }
+        macrocellGrid->set(ci, cj, ck, lo, hi);
+      }
+    }
+  }
+
+  // the outermost voxels continue beyond the box
+  float lo = INF_F, hi = 0.f;
+  for (size_t k = 0; k < nz; k++) {
+    for (size_t j = 0; j < ny; j++) {
+      for (size_t i = 0; i < nx; i++) {
+        if (i && j && k && i < nx - 1 && j < ny - 1 && k < nz - 1) continue;
+        float sigma_t = extinctions[i + nx * (j + ny * k)];
+        lo = std::min(lo, sigma_t);
+        hi = std::max(hi, sigma_t);
+      }
+    }
+  }
+  macrocellGrid->set_outside(lo, hi);
+}
+
+GridMedium* GridMedium::load(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  VolHeader header;
+  if (!read_vol_header(in, &header)) return NULL;
+
+  size_t n = size_t(header.res[0]) * header.res[1] * header.res[2];
+  std::vector<float> data(n * header.channels);
+  if (!in.read((char*) data.data(), sizeof(float) * data.size())) return NULL;
+
+  std::vector<float> extinction(n), albedo(n);
+  std::vector<Spectrum> phase(n);
+  for (size_t i = 0; i < n; i++)
+    read_voxel(&data[i * header.channels], header.channels,
+               &extinction[i], &albedo[i], &phase[i]);
+  return new GridMedium(header.res[0], header.res[1], header.res[2],
+                        grid_to_world(header), extinction, albedo, phase);
+}
+
+GridMedium::Cell GridMedium::locate(const Vector3D& p) const {
+  Vector3D g = to_grid(p);
+  Cell cell;
+  cell.base = 0;
+  locate_axis(g.x, nx, 1, &cell.base, &cell.dx, &cell.tx);
+  locate_axis(g.y, ny, nx, &cell.base, &cell.dy, &cell.ty);
+  locate_axis(g.z, nz, nx * ny, &cell.base, &cell.dz, &cell.tz);
+  return cell;
+}
+
+template <typename T>
+T GridMedium::interpolate(const std::vector<T>& data, const Cell& cell) const {
+  const T* v = &data[cell.base];
+  size_t dx = cell.dx, dy = cell.dy, dz = cell.dz;
+  T v00 = v[0] + (v[dx] - v[0]) * cell.tx;
+  T v10 = v[dy] + (v[dy + dx] - v[dy]) * cell.tx;
+  T v01 = v[dz] + (v[dz + dx] - v[dz]) * cell.tx;
+  T v11 = v[dz + dy] + (v[dz + dy + dx] - v[dz + dy]) * cell.tx;
+  T v0 = v00 + (v10 - v00) * cell.ty;
+  T v1 = v01 + (v11 - v01) * cell.ty;
+  return v0 + (v1 - v0) * cell.tz;
+}
+
+double GridMedium::extinction(const Vector3D& p) const {
+  return interpolate(extinctions, locate(p));
+}
+
+double GridMedium::scattering(const Vector3D& p) const {
+  Cell cell = locate(p);
+  return interpolate(albedos, cell) * interpolate(extinctions, cell);
+}
+
+Spectrum GridMedium::phase(const Vector3D& p) const {
+  return interpolate(phases, locate(p));
+}
+
+// Brick Medium //
+
+BrickMedium::BrickMedium(size_t nx, size_t ny, size_t nz,
+                         const Matrix4x4& grid_to_world)
+  : VoxelMedium(nx, ny, nz, grid_to_world),
+    // a brick for every voxel a cell can start at
+    bx((nx - 1) / kBrickSize + 1), by((ny - 1) / kBrickSize + 1),
+    bz((nz - 1) / kBrickSize + 1), brickIndex(bx * by * bz, 0) { }
+
+BrickMedium* BrickMedium::load(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  VolHeader header;
+  if (!read_vol_header(in, &header)) return NULL;
+
+  size_t nx = header.res[0], ny = header.res[1], nz = header.res[2];
+  size_t channels = header.channels;
+  BrickMedium* medium = new BrickMedium(nx, ny, nz, grid_to_world(header));
+
+  // the slices a layer of bricks spans, slice z in slot z % kBrickSide
+  size_t slice_size = nx * ny * channels;
+  std::vector<float> slices(kBrickSide * slice_size);
+  size_t slices_read = 0;
+  Brick brick;
+  for (size_t k = 0; k < medium->bz; k++) {
+    size_t z_end = std::min((k + 1) * kBrickSize, nz - 1);
+    for (; slices_read <= z_end; slices_read++) {
+      float* slice = &slices[(slices_read % kBrickSide) * slice_size];
+      if (!in.read((char*) slice, sizeof(float) * slice_size)) {
+        delete medium;
+        return NULL;
+      }
+    }
+
+    for (size_t j = 0; j < medium->by; j++) {
+      for (size_t i = 0; i < medium->bx; i++) {
+        bool occupied = false;
+        float lo = INF_F, hi = 0.f;
+        for (size_t w = 0; w < kBrickSide; w++) {
+          size_t z = std::min(k * kBrickSize + w, nz - 1);
+          for (size_t v = 0; v < kBrickSide; v++) {
+            size_t y = std::min(j * kBrickSize + v, ny - 1);
+            for (size_t u = 0; u < kBrickSide; u++) {
+              size_t x = std::min(i * kBrickSize + u, nx - 1);
+              const float* voxel = &slices[(z % kBrickSide) * slice_size +
+                                           (x + y * nx) * channels];
+              float extinction, albedo;
+              Spectrum phase;
+              read_voxel(voxel, channels, &extinction, &albedo, &phase);
+              size_t b = u + kBrickSide * (v + kBrickSide * w);
+              brick.extinction[b] = float_to_half(extinction);
+              brick.albedo[b] = float_to_half(albedo);
+              brick.phase[0][b] = float_to_half(phase.r);
+              brick.phase[1][b] = float_to_half(phase.g);
+              brick.phase[2][b] = float_to_half(phase.b);
+              occupied = occupied || (brick.extinction[b] & 0x7fff);
+              lo = std::min(lo, half_to_float(brick.extinction[b]));
+              hi = std::max(hi, half_to_float(brick.extinction[b]));
+            }
+          }
+        }
+        // the bricks are the macrocells, but for a last layer of bricks
+        // starting at the last voxel, which the macrocells leave out
+        MacrocellGrid* macrocells = medium->macrocellGrid;
+        if (i < macrocells->size(0) && j < macrocells->size(1) && k < macrocells->size(2))
+          macrocells->set(i, j, k, lo, hi);
+        if (!occupied) continue;
+        medium->bricks.push_back(brick);
+        medium->brickIndex[i + medium->bx * (j + medium->by * k)] = medium->bricks.size();
+      }
+    }
+  }
+  return medium;
+}
+
+bool BrickMedium::locate(const Vector3D& p, Cell* cell) const {
+  Vector3D g = to_grid(p);
+  if (!(g.x >= 0. && g.y >= 0. && g.z >= 0. &&
+        g.x <= nx - 1. && g.y <= ny - 1. && g.z <= nz - 1.))
+    return false;
+
+  size_t x = size_t(int64_t(g.x)), y = size_t(int64_t(g.y)), z = size_t(int64_t(g.z));
+  uint32_t id = brickIndex[x / kBrickSize + bx * (y / kBrickSize + by * (z / kBrickSize))];
+  if (!id) return false;
+  cell->brick = &bricks[id - 1];
+  cell->base = x % kBrickSize + kBrickSide * (y % kBrickSize + kBrickSide * (z % kBrickSize));
+  cell->tx = float(g.x - x);
+  cell->ty = float(g.y - y);
+  cell->tz = float(g.z - z);
+  return true;
+}
+
+float BrickMedium::interpolate(const uint16_t* data, const Cell& cell) const {
+  const uint16_t* v = data + cell.base;
+  const size_t dy = kBrickSide, dz = kBrickSide * kBrickSide;
+  float v00 = lerp(half_to_float(v[0]), half_to_float(v[1]), cell.tx);
+  float v10 = lerp(half_to_float(v[dy]), half_to_float(v[dy + 1]), cell.tx);
+  float v01 = lerp(half_to_float(v[dz]), half_to_float(v[dz + 1]), cell.tx);
+  float v11 = lerp(half_to_float(v[dz + dy]), half_to_float(v[dz + dy + 1]), cell.tx);
+  return lerp(lerp(v00, v10, cell.ty), lerp(v01, v11, cell.ty), cell.tz);
+}
+
+double BrickMedium::extinction(const Vector3D& p) const {
+  Cell cell;
+  if (!locate(p, &cell)) return 0.;
+  return interpolate(cell.brick->extinction, cell);
+}
+
+double BrickMedium::scattering(const Vector3D& p) const {
+  Cell cell;
+  if (!locate(p, &cell)) return 0.;
+  return interpolate(cell.brick->albedo, cell) *
+         interpolate(cell.brick->extinction, cell);
+}
+
+Spectrum BrickMedium::phase(const Vector3D& p) const {
+  Cell cell;
+  if (!locate(p, &cell)) return Spectrum();
+  return Spectrum(interpolate(cell.brick->phase[0], cell),
+                  interpolate(cell.brick->phase[1], cell),
+                  interpolate(cell.brick->phase[2], cell));
+}
+
+} // namespace CGL
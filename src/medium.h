@@ -0,0 +1,347 @@
+#ifndef CGL_MEDIUM_H
+#define CGL_MEDIUM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "CGL/vector3D.h"
+#include "CGL/matrix4x4.h"
+#include "CGL/spectrum.h"
+#include "ray.h"
+#include "bbox.h"
+
+namespace CGL {
+
+class BrickedNoise;
+class MacrocellGrid;
+class Medium;
+class Phase;
+
+/**
+ * A stretch [t0, t1) of a ray that lies within a single medium.
+ */
+struct MediumRegion {
+  double t0, t1;
+  const Medium* medium;
+};
+
+/**
+ * Interface for the participating medium filling the scene. It gives the
+ * extinction and scattering coefficients at every point, and the k of the
+ * Schlick phase function light scatters by there.
+ */
+class Medium {
+ public:
+
+  virtual ~Medium() { }
+
+  /**
+   * Get the extinction coefficient at p.
+   */
+  virtual double extinction(const Vector3D& p) const = 0;
+
+  /**
+   * Get the scattering coefficient at p.
+   */
+  virtual double scattering(const Vector3D& p) const = 0;
+
+  /**
+   * Get the asymmetry k of each channel of the Schlick phase function at p.
+   */
+  virtual Spectrum phase(const Vector3D& p) const = 0;
+
+  /**
+   * Get the phase function light scatters by everywhere in the medium,
+   * NULL if it is the Schlick phase function given by phase.
+   */
+  virtual const Phase* phase_function() const { return NULL; }
+
+  /**
+   * Get an upper bound of the extinction coefficient everywhere, the
+   * majorant delta tracking samples tentative collisions against where
+   * there are no macrocells.
+   */
+  virtual double majorant() const = 0;
+
+  /**
+   * Get a lower bound of the extinction coefficient everywhere, the
+   * control extinction residual ratio tracking integrates analytically.
+   * A medium whose minorant equals its majorant is homogeneous, and is
+   * sampled in closed form.
+   */
+  virtual double minorant() const { return 0.; }
+
+  /**
+   * Get the grid of local bounds of the extinction tracking walks through,
+   * NULL if there is none.
+   */
+  virtual const MacrocellGrid* macrocells() const { return NULL; }
+
+  /**
+   * Get the next region of r from t on, up to max_t, that lies within a
+   * single medium, skipping empty space. Returns false if there is none.
+   * A plain medium is a single region, itself.
+   */
+  virtual bool next_region(const Ray& r, double t, double max_t,
+                           MediumRegion* region) const;
+
+};
+
+/**
+ * The medium the renderer was written for: three ellipsoids of cloud
+ * (kumo) in a clear sky (sora). The cloud's density varies with fBm noise,
+ * evaluated into cached bricks as the cloud is looked up.
+ */
+class CloudMedium : public Medium {
+ public:
+
+  /**
+   * Constructor. Covers the cloud with macrocells of about a quarter unit.
+   * \param noise_cache bytes the bricks of noise may take
+   */
+  CloudMedium(size_t noise_cache = size_t(16) << 20);
+
+  ~CloudMedium();
+
+  double extinction(const Vector3D& p) const;
+  double scattering(const Vector3D& p) const;
+  Spectrum phase(const Vector3D& p) const;
+  double majorant() const;
+  double minorant() const;
+  const MacrocellGrid* macrocells() const { return macrocellGrid; }
+
+ private:
+  MacrocellGrid* macrocellGrid;
+  BrickedNoise* noise;
+};
+
+/**
+ * A medium of constant coefficients, filling either all of space or a box.
+ * It scatters isotropically unless given a phase function. Rays are tracked
+ * through it in closed form, and those missing the box never look it up.
+ */
+class HomogeneousMedium : public Medium {
+ public:
+
+  /**
+   * Constructor.
+   * \param extinction extinction coefficient
+   * \param scattering scattering coefficient
+   * \param bounds the box filled, of positive volume, or empty to fill all
+   *        of space
+   */
+  HomogeneousMedium(double extinction, double scattering,
+                    const BBox& bounds = BBox());
+
+  /**
+   * Set the phase function to scatter by, which the medium takes ownership
+   * of.
+   */
+  void set_phase_function(const Phase* phase) { phaseFunction = phase; }
+
+  ~HomogeneousMedium();
+
+  /**
+   * Parse a medium from "extinction,scattering", optionally followed by
+   * ",x0,y0,z0,x1,y1,z1" giving the corners of its box. Returns NULL if
+   * spec is malformed, the coefficients are negative, scattering exceeds
+   * extinction or the box is flat.
+   */
+  static HomogeneousMedium* parse(const std::string& spec);
+
+  double extinction(const Vector3D& p) const;
+  double scattering(const Vector3D& p) const;
+  Spectrum phase(const Vector3D& p) const { return Spectrum(); }
+  const Phase* phase_function() const { return phaseFunction; }
+  double majorant() const { return sigma_t; }
+  double minorant() const { return bounds.empty() ? sigma_t : 0.; }
+  const MacrocellGrid* macrocells() const { return macrocellGrid; }
+
+ private:
+  double sigma_t, sigma_s;
+  BBox bounds;
+  MacrocellGrid* macrocellGrid;  ///< a single cell over bounds, NULL if unbounded
+  const Phase* phaseFunction;    ///< NULL if isotropic
+};
+
+/**
+ * Base of the media given by a 3D grid of voxels, interpolated trilinearly.
+ * A transform places the grid in the world, voxel (i, j, k) sitting at grid
+ * coordinates (i, j, k).
+ */
+class VoxelMedium : public Medium {
+ public:
+
+  ~VoxelMedium();
+
+  double majorant() const;
+  double minorant() const;
+  const MacrocellGrid* macrocells() const { return macrocellGrid; }
+
+  /**
+   * Get the world space box spanned by the voxel centers.
+   */
+  const BBox& get_bbox() const { return bbox; }
+
+ protected:
+
+  static const size_t kMacrocellSize = 8;  ///< voxels along each side of a macrocell
+
+  /**
+   * Constructor. Macrocell (i, j, k) spans the cells between voxels
+   * kMacrocellSize * (i, j, k) and kMacrocellSize * (i + 1, j + 1, k + 1),
+   * and its bounds are left for the subclass to set.
+   * \param nx, ny, nz number of voxels along each axis
+   * \param grid_to_world transform from grid to world coordinates
+   */
+  VoxelMedium(size_t nx, size_t ny, size_t nz, const Matrix4x4& grid_to_world);
+
+  /**
+   * Get the grid coordinates of p.
+   */
+  Vector3D to_grid(const Vector3D& p) const {
+    return Vector3D(dot(world_to_grid[0], p), dot(world_to_grid[1], p),
+                    dot(world_to_grid[2], p)) + grid_offset;
+  }
+
+  size_t nx, ny, nz;
+  MacrocellGrid* macrocellGrid;
+
+ private:
+  Vector3D world_to_grid[3];  ///< rows of the affine world to grid transform
+  Vector3D grid_offset;       ///< its translation
+  BBox bbox;
+};
+
+/**
+ * A medium given by a dense grid of extinction coefficients, albedos and
+ * phase function parameters. Outside its bounds the grid continues its
+ * outermost voxels.
+ */
+class GridMedium : public VoxelMedium {
+ public:
+
+  /**
+   * Constructor. The voxels are stored x fastest, then y, then z.
+   * \param nx, ny, nz number of voxels along each axis
+   * \param grid_to_world transform from grid to world coordinates
+   * \param extinction extinction coefficient of each voxel
+   * \param albedo ratio of scattering to extinction of each voxel
+   * \param phase Schlick k of each voxel
+   */
+  GridMedium(size_t nx, size_t ny, size_t nz, const Matrix4x4& grid_to_world,
+             const std::vector<float>& extinction,
+             const std::vector<float>& albedo,
+             const std::vector<Spectrum>& phase);
+
+  /**
+   * Load a grid from a Mitsuba gridvolume (.vol) file of float32 voxels
+   * with 1, 2 or 5 channels: extinction, then albedo, then the Schlick k
+   * of each color channel. Missing albedos are 1 and missing k are 0. The
+   * file's bounding box spans the centers of the outermost voxels.
+   * Returns NULL if the file cannot be read.
+   */
+  static GridMedium* load(const std::string& filename);
+
+  double extinction(const Vector3D& p) const;
+  double scattering(const Vector3D& p) const;
+  Spectrum phase(const Vector3D& p) const;
+
+ private:
+
+  /**
+   * The 8 voxels around a point: the first, the offsets of the next along
+   * each axis, and the point's position between them.
+   */
+  struct Cell {
+    size_t base, dx, dy, dz;
+    float tx, ty, tz;
+  };
+
+  /**
+   * Get the cell of p.
+   */
+  Cell locate(const Vector3D& p) const;
+
+  /**
+   * Interpolate data trilinearly within cell.
+   */
+  template <typename T>
+  T interpolate(const std::vector<T>& data, const Cell& cell) const;
+
+  std::vector<float> extinctions;
+  std::vector<float> albedos;
+  std::vector<Spectrum> phases;
+};
+
+/**
+ * A medium given by a sparse grid of the same voxels as GridMedium, for
+ * clouds in empty space. The grid is split into bricks of 8^3 voxels, and
+ * only the bricks that reach nonzero extinction are stored, in half
+ * precision, found through a coarse grid of brick ids. Each brick also
+ * holds the voxels bordering it on its upper sides, so that every
+ * trilinear lookup reads a single brick. Outside its bounds the medium is
+ * empty.
+ */
+class BrickMedium : public VoxelMedium {
+ public:
+
+  /**
+   * Load a grid from a .vol file like GridMedium::load, reading it a few
+   * slices at a time so that the dense grid is never in memory. Returns
+   * NULL if the file cannot be read.
+   */
+  static BrickMedium* load(const std::string& filename);
+
+  double extinction(const Vector3D& p) const;
+  double scattering(const Vector3D& p) const;
+  Spectrum phase(const Vector3D& p) const;
+
+  /**
+   * Get the number of bricks stored.
+   */
+  size_t num_bricks() const { return bricks.size(); }
+
+ private:
+
+  static const size_t kBrickSize = kMacrocellSize;   ///< voxels along each side
+  static const size_t kBrickSide = kBrickSize + 1;   ///< with the bordering voxels
+  static const size_t kBrickVoxels = kBrickSide * kBrickSide * kBrickSide;
+
+  struct Brick {
+    uint16_t extinction[kBrickVoxels];
+    uint16_t albedo[kBrickVoxels];
+    uint16_t phase[3][kBrickVoxels];
+  };
+
+  /**
+   * The brick holding the 8 voxels around a point, the first of them and
+   * the point's position between them.
+   */
+  struct Cell {
+    const Brick* brick;
+    size_t base;
+    float tx, ty, tz;
+  };
+
+  BrickMedium(size_t nx, size_t ny, size_t nz, const Matrix4x4& grid_to_world);
+
+  /**
+   * Get the cell of p. Returns false if p is in empty space.
+   */
+  bool locate(const Vector3D& p, Cell* cell) const;
+
+  /**
+   * Interpolate half precision data trilinearly within cell.
+   */
+  float interpolate(const uint16_t* data, const Cell& cell) const;
+
+  size_t bx, by, bz;                ///< number of bricks along each axis
+  std::vector<uint32_t> brickIndex; ///< brick id + 1 of each brick, 0 if empty
+  std::vector<Brick> bricks;
+};
+
+} // namespace CGL
+
+#endif // CGL_MEDIUM_H
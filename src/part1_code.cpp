@@ -11,6 +11,44 @@ using std::min;
 using std::max;
 
 namespace CGL {
+  namespace {
+    // ratio of the upper to the lower bound of the weight window; wider
+    // than the paper's 5, since the cache and the pixel estimates are coarse
+    const double kWeightWindow = 20.;
+    // lowest survival probability of the roulette, so that a cache that
+    // wrongly reads zero cannot starve a region completely
+    const double kMinSurvival = 0.05;
+    const size_t kMaxSplit = 8;
+
+    // illuminance estimate of the pixel the calling thread traces
+    thread_local double pixel_estimate = 0.;
+
+    // share of the directions a guided vertex takes from the guide
+    const double kGuidingFraction = 0.5;
+
+    // Samples w_in from the mixture of the guide and the BSDF or phase
+    // function s, with the pdf of the mixture (one-sample MIS), and returns
+    // s at w_in. Without a guide this is s->sample_f.
+    template <typename Scattering>
+    Spectrum sample_guided(Scattering* s, const DirectionalTree* guide,
+                           const Matrix3x3& o2w, const Vector3D& w_out,
+                           Vector3D* w_in, float* pdf) {
+      if (!guide) return s->sample_f(w_out, w_in, pdf);
+
+      Spectrum f;
+      if (sample_1d() < kGuidingFraction) {
+        *w_in = o2w.T() * guide->sample(sample_2d());
+        f = s->f(w_out, *w_in);
+      } else {
+        float pdf_s;
+        f = s->sample_f(w_out, w_in, &pdf_s);
+      }
+      *pdf = kGuidingFraction * guide->pdf(o2w * *w_in) +
+             (1. - kGuidingFraction) * s->pdf(w_out, *w_in);
+      return f;
+    }
+  }
+
   Spectrum PathTracer::estimate_reduced_radiance(const Spectrum &src_radiance, const Vector3D &src, const Vector3D &recv)
   {
     // Estimate the radiance to at the recv point
@@ -22,24 +60,19 @@ namespace CGL {
     double max_t = (src - recv).norm();
     Vector3D d = (recv - src).unit();
 
-    double extinction, optical_depth = 0., total_dist = 0.;
-    // printf("max_t: %f\n", max_t);
-    
-    while (true) {
-      extinction = pos2extinction(src + d * total_dist);
+    TransmittanceEstimator estimator(medium, residualTracking);
+    return src_radiance * estimator.estimate(Ray(src, d), max_t);
+  }
 
-      // have reached the nearest surface
-      if (total_dist + space_step > max_t) {
-        optical_depth += extinction * (max_t - total_dist);
-        break;
-      }
-      else {
-        optical_depth += extinction * space_step;
-        total_dist += space_step;
-      }
-    }
-    
-    return src_radiance * exp(-optical_depth);
+  Spectrum PathTracer::estimate_light_radiance(const Spectrum &src_radiance, const Vector3D &recv,
+                                               const Vector3D &wi, double dist)
+  {
+    if (dist < INF_D)
+      return estimate_reduced_radiance(src_radiance, recv + dist * wi, recv);
+    // a distant light lies at infinity, where no ray can start, so
+    // the transmittance is tracked outward from recv instead
+    TransmittanceEstimator estimator(medium, residualTracking);
+    return src_radiance * estimator.estimate(Ray(recv, wi), INF_D);
   }
 
   Spectrum PathTracer::estimate_direct_lighting_hemisphere(
@@ -122,8 +155,8 @@ namespace CGL {
             Spectrum L_reduced = estimate_reduced_radiance(
               emission, biased_hit_p, light_pos);
             L_out += 
-              (4 * PI / double(num_samples)) * pos2scattering(hit_p) / pos2extinction(hit_p) *
-              L_reduced * interact.phase -> f(w_out, wi);
+              (4 * PI / double(num_samples)) * interact.medium -> scattering(hit_p) / interact.medium -> extinction(hit_p) *
+              L_reduced * interact.phase() -> f(w_out, wi);
           }
         }
 
@@ -132,6 +165,7 @@ namespace CGL {
     }
   }
 
+  template <bool kDeltaLightsOnly>
   Spectrum PathTracer::estimate_direct_lighting_importance(
     const Ray& r, const Intersection& isect, const Interaction& interact) {
     // Estimate the lighting from this intersection coming directly from a light.
@@ -161,7 +195,7 @@ namespace CGL {
         Vector3D wi;
         float dist, pdf;
 
-        if (light -> is_delta_light()) {
+        if (kDeltaLightsOnly || light -> is_delta_light()) {
           // one sample
           Spectrum radiance_in = light -> sample_L(hit_p, &wi, &dist, &pdf);
           if (radiance_in != Spectrum()) {
@@ -178,9 +212,8 @@ namespace CGL {
 
           Intersection i;
           if (not bvh -> intersect(out_ray, &i)) {
-            Vector3D light_pos = biased_hit_p + dist * wi;
-            Spectrum L_reduced = estimate_reduced_radiance(
-              radiance_in, light_pos, biased_hit_p);
+            Spectrum L_reduced = estimate_light_radiance(
+              radiance_in, biased_hit_p, wi, dist);
             L_out += L_reduced * isect.bsdf -> f(w_out, w_in) * 
               cos_theta(w_in) / pdf;
             // std::cout << "bsdf delta: " << L_out << std::endl;
@@ -205,9 +238,8 @@ namespace CGL {
 
             Intersection i;
             if (not bvh -> intersect(out_ray, &i)) {
-              Vector3D light_pos = biased_hit_p + dist * wi;
-              Spectrum L_reduced = estimate_reduced_radiance(
-                radiance_in, light_pos, biased_hit_p);
+              Spectrum L_reduced = estimate_light_radiance(
+                radiance_in, biased_hit_p, wi, dist);
               L_out += (1. / ns_area_light) * 
                 L_reduced * isect.bsdf -> f(w_out, w_in) * cos_theta(w_in) / pdf;
               // std::cout << "bsdf: " << L_out << std::endl;
@@ -236,7 +268,7 @@ namespace CGL {
         Vector3D wi;
         float dist, pdf;
 
-        if (light -> is_delta_light()) {
+        if (kDeltaLightsOnly || light -> is_delta_light()) {
           Spectrum radiance_in = light -> sample_L(hit_p, &wi, &dist, &pdf);
           if (radiance_in != Spectrum()) {
             // std::cout << "Sample_L: " << radiance_in << std::endl;
@@ -251,13 +283,12 @@ namespace CGL {
 
           Intersection i;
           if (not bvh -> intersect(out_ray, &i)) {
-            Vector3D light_pos = biased_hit_p + dist * wi;
-            Spectrum L_reduced = estimate_reduced_radiance(
-              radiance_in, light_pos, biased_hit_p);
+            Spectrum L_reduced = estimate_light_radiance(
+              radiance_in, biased_hit_p, wi, dist);
             // std::cout << "Sample_L: " << radiance_in << std::endl;
             // std::cout << "L_reduced: " << L_reduced << std::endl;
-            L_out += pos2scattering(hit_p) / pos2extinction(hit_p) *
-              L_reduced * interact.phase -> f(w_out, w_in) / pdf;
+            L_out += interact.medium -> scattering(hit_p) / interact.medium -> extinction(hit_p) *
+              L_reduced * interact.phase() -> f(w_out, w_in) / pdf;
             // std::cout << "phase delta: " << L_out << std::endl;
             // std::cout << "phase delta dist: " << dist << std::endl;
           }
@@ -279,11 +310,10 @@ namespace CGL {
 
             Intersection i;
             if (not bvh -> intersect(out_ray, &i)) {
-              Vector3D light_pos = biased_hit_p + dist * wi;
-              Spectrum L_reduced = estimate_reduced_radiance(
-                radiance_in, light_pos, biased_hit_p);
-              L_out += (1. / ns_area_light) * (pos2scattering(hit_p) / pos2extinction(hit_p)) * 
-                L_reduced * interact.phase -> f(w_out, w_in) / pdf;
+              Spectrum L_reduced = estimate_light_radiance(
+                radiance_in, biased_hit_p, wi, dist);
+              L_out += (1. / ns_area_light) * (interact.medium -> scattering(hit_p) / interact.medium -> extinction(hit_p)) * 
+                L_reduced * interact.phase() -> f(w_out, w_in) / pdf;
               // std::cout << "phase: " << L_out << std::endl;
             }
           }
@@ -307,21 +337,51 @@ namespace CGL {
         isect.bsdf -> get_emission(), p, r.o);
   }
 
+  template <DirectLightingStrategy kStrategy>
   Spectrum PathTracer::one_bounce_radiance(
     const Ray&r, const Intersection& isect, const Interaction& interact) {
     // Returns either the direct illumination by hemisphere or importance sampling
-    // depending on `direct_hemisphere_sample`
+    // depending on kStrategy, which follows `direct_hemisphere_sample`
     // (you implemented these functions in Part 3)
 
     // return Spectrum();
-    if (direct_hemisphere_sample)
+    if (kStrategy == kHemisphereSampling)
       return estimate_direct_lighting_hemisphere(r, isect, interact);
     else
-      return estimate_direct_lighting_importance(r, isect, interact);
+      return estimate_direct_lighting_importance<kStrategy == kDeltaLightSampling>(
+        r, isect, interact);
   }
 
+  size_t PathTracer::sample_continuations(
+    const Vector3D& p, double throughput, double* weight) {
+    double radiance;
+    if (radianceCache && pixel_estimate > 0 && radianceCache->lookup(p, &radiance)) {
+      // keep the expected contribution of each continuation inside a window
+      // around the pixel's estimate (Vorba and Krivanek 2016): roulette
+      // paths below it, split paths above it
+      double expected = throughput * radiance;
+      double lower = 2. * pixel_estimate / (1. + kWeightWindow);
+      double upper = kWeightWindow * lower;
+      if (expected < lower) {
+        double survival = max(expected / lower, kMinSurvival);
+        *weight = 1. / survival;
+        return coin_flip(survival) ? 1 : 0;
+      }
+      size_t n = expected > upper ? min<size_t>(ceil(expected / upper), kMaxSplit) : 1;
+      *weight = 1. / n;
+      return n;
+    }
+
+    // until the cache knows the place, roulette and split into two paths
+    float cpdf = 0.6;
+    *weight = 1. / (2. * cpdf);
+    return coin_flip(cpdf) ? 2 : 0;
+  }
+
+  template <DirectLightingStrategy kStrategy>
   Spectrum PathTracer::at_least_one_bounce_radiance(
-    const Ray&r, const Intersection& isect, const Interaction& interact) {
+    const Ray&r, const Intersection& isect, const Interaction& interact,
+    double throughput, Spectrum* direct) {
 
     // reflect
     if (not interact.interacted) {
@@ -334,8 +394,9 @@ namespace CGL {
 
       Spectrum L_out = Spectrum();
       if (!isect.bsdf -> is_delta()) {
-        L_out += one_bounce_radiance(r, isect, interact);
+        L_out += one_bounce_radiance<kStrategy>(r, isect, interact);
       }
+      if (direct) *direct = L_out;
 
       // TODO (Part 4.2): 
       // Here is where your code for sampling the BSDF,
@@ -343,47 +404,58 @@ namespace CGL {
       // traced ray (when applicable) goes
       Vector3D w_in;
       float pdf_dir;
-      Spectrum sampled_bsdf = isect.bsdf ->sample_f(w_out, &w_in, &pdf_dir);
+      const DirectionalTree* guide = guidingField && !isect.bsdf -> is_delta() ?
+        guidingField -> lookup(hit_p) : NULL;
+      Spectrum sampled_bsdf = sample_guided(isect.bsdf, guide, o2w, w_out, &w_in, &pdf_dir);
+      // the guide may pick directions below the surface, which reflect nothing
+      Spectrum f = pdf_dir != 0 && (!guide || w_in.z > 0) ?
+        sampled_bsdf * abs_cos_theta(w_in) / pdf_dir : Spectrum();
       
-      float cpdf = 0.6;
-      // if (false) {
-      // if ((r.depth > 1 and coin_flip(cpdf)) or (r.depth == max_ray_depth)) {
-      if ((r.depth > 1 and coin_flip(cpdf))) {
-        Vector3D wi = o2w * w_in;
+      double weight;
+      size_t num_paths = r.depth > 1 ? sample_continuations(hit_p, throughput, &weight) : 0;
+      Spectrum L_ind = Spectrum(), L_in = Spectrum();
+      Vector3D wi = o2w * w_in;
+      if (num_paths) {
         Ray new_ray = Ray(hit_p + EPS_D * wi, wi, INF_D, r.depth - 1);
         Intersection i;
         if (bvh -> intersect(new_ray, &i)) {
-          for (size_t j = 0; j < 2; j++) {
+          for (size_t j = 0; j < num_paths; j++) {
             
             Interaction ita;
             float pdf_dist;
-            DistanceSampler1D* distanceSampler = new DistanceSampler1D(&pos2extinction, space_step);
-            distanceSampler -> set_ray(&new_ray);
-            distanceSampler -> set_max_t(i.t);
-            double sampled_dist = distanceSampler -> get_sample(&pdf_dist);
-            delete distanceSampler;
+            const Medium* collision_medium;
+            DistanceSampler1D distanceSampler(medium);
+            distanceSampler.set_ray(&new_ray);
+            distanceSampler.set_max_t(i.t);
+            double sampled_dist = distanceSampler.get_sample(&pdf_dist, &collision_medium);
 
             if (sampled_dist >= i.t) {
               ita.interacted = false;
             }
             else {
               Vector3D next_ita_point = new_ray.o + new_ray.d * sampled_dist;
-              SchlickPhase *phase_pos = new SchlickPhase(pos2phase(next_ita_point));
-
               ita.interacted = true;
+              ita.medium = collision_medium;
               ita.t = sampled_dist;
               new_ray.max_t = sampled_dist;
               ita.n = -new_ray.d;
-              ita.phase = phase_pos;
+              ita.set_phase(collision_medium, next_ita_point);
             } 
-            Spectrum radiance_in = at_least_one_bounce_radiance(new_ray, i, ita);
+            Spectrum radiance_in = at_least_one_bounce_radiance<kStrategy>(
+              new_ray, i, ita, throughput * weight * f.illum());
             if (isect.bsdf -> is_delta())
               radiance_in += zero_bounce_radiance(new_ray, i, ita);
             if (pdf_dir != 0)
-              L_out += (1. / 2.) * radiance_in * sampled_bsdf * abs_cos_theta(w_in) / pdf_dir / cpdf;
+              L_ind += weight * radiance_in * f;
+            L_in += weight * radiance_in;
           }
         }
       }
+      if (radianceCache && r.depth > 1)
+        radianceCache->record(hit_p, L_ind.illum());
+      if (guidingField && !isect.bsdf -> is_delta() && w_in.z > 0 && num_paths && pdf_dir != 0)
+        guidingField->record(hit_p, wi, L_in.illum() / pdf_dir);
+      L_out += L_ind;
       
       return L_out;
     }
@@ -397,7 +469,8 @@ namespace CGL {
       Vector3D w_out = w2o * (-r.d);
 
       Spectrum L_out = Spectrum();
-      L_out += one_bounce_radiance(r, isect, interact);
+      L_out += one_bounce_radiance<kStrategy>(r, isect, interact);
+      if (direct) *direct = L_out;
 
       // TODO (Part 4.2): 
       // Here is where your code for sampling the BSDF,
@@ -405,47 +478,53 @@ namespace CGL {
       // traced ray (when applicable) goes
       Vector3D w_in;
       float pdf_dir;
-      Spectrum sampled_phase_f = interact.phase ->sample_f(w_out, &w_in, &pdf_dir);
-      delete interact.phase;
+      const DirectionalTree* guide = guidingField ? guidingField -> lookup(hit_p) : NULL;
+      Spectrum sampled_phase_f = sample_guided(interact.phase(), guide, o2w, w_out, &w_in, &pdf_dir);
+      Spectrum f = pdf_dir != 0 ?
+        interact.medium -> scattering(hit_p) / interact.medium -> extinction(hit_p) * sampled_phase_f / pdf_dir : Spectrum();
       
-      float cpdf = 0.6;
-      // if (false) {
-      // if ((r.depth > 1 and coin_flip(cpdf)) or (r.depth == max_ray_depth)) {
-
-      if ((r.depth > 1 and coin_flip(cpdf))) {
-        Vector3D wi = o2w * w_in;
+      double weight;
+      size_t num_paths = r.depth > 1 ? sample_continuations(hit_p, throughput, &weight) : 0;
+      Spectrum L_ind = Spectrum(), L_in = Spectrum();
+      Vector3D wi = o2w * w_in;
+      if (num_paths) {
         Ray new_ray = Ray(hit_p + EPS_D * wi, wi, INF_D, r.depth - 1);
         Intersection i;
         if (bvh -> intersect(new_ray, &i)) {
-          for (size_t j = 0; j < 2; j++) {
+          for (size_t j = 0; j < num_paths; j++) {
 
             Interaction ita;
             float pdf_dist;
-            DistanceSampler1D* distanceSampler = new DistanceSampler1D(&pos2extinction, space_step);
-            distanceSampler -> set_ray(&new_ray);
-            distanceSampler -> set_max_t(i.t);
-            double sampled_dist = distanceSampler -> get_sample(&pdf_dist);
-            delete distanceSampler;
+            const Medium* collision_medium;
+            DistanceSampler1D distanceSampler(medium);
+            distanceSampler.set_ray(&new_ray);
+            distanceSampler.set_max_t(i.t);
+            double sampled_dist = distanceSampler.get_sample(&pdf_dist, &collision_medium);
             if (sampled_dist >= i.t) {
               ita.interacted = false;
             }
             else {
               Vector3D next_ita_point = new_ray.o + new_ray.d * sampled_dist;
-              SchlickPhase *phase_pos = new SchlickPhase(pos2phase(next_ita_point));
-
               ita.interacted = true;
+              ita.medium = collision_medium;
               ita.t = sampled_dist;
               new_ray.max_t = sampled_dist;
               ita.n = -new_ray.d;
-              ita.phase = phase_pos;
+              ita.set_phase(collision_medium, next_ita_point);
             } 
-            Spectrum radiance_in = at_least_one_bounce_radiance(new_ray, i, ita);
+            Spectrum radiance_in = at_least_one_bounce_radiance<kStrategy>(
+              new_ray, i, ita, throughput * weight * f.illum());
             if (pdf_dir != 0)
-              L_out += (1. / 2. ) * pos2scattering(hit_p) / pos2extinction(hit_p) *
-                radiance_in * sampled_phase_f / pdf_dir / cpdf;
+              L_ind += weight * radiance_in * f;
+            L_in += weight * radiance_in;
           }
         }
       }
+      if (radianceCache && r.depth > 1)
+        radianceCache->record(hit_p, L_ind.illum());
+      if (guidingField && num_paths && pdf_dir != 0)
+        guidingField->record(hit_p, wi, L_in.illum() / pdf_dir);
+      L_out += L_ind;
       // if (r.depth == max_ray_depth) {
       //   std::cout << L_out << std::endl;
       // }
@@ -454,7 +533,9 @@ namespace CGL {
     }
   }
 
-  Spectrum PathTracer::est_radiance_global_illumination(Ray &r) {
+  template <DirectLightingStrategy kStrategy>
+  Spectrum PathTracer::est_radiance_global_illumination(
+    Ray &r, const PrimaryHit* primary, RadianceComponents* components) {
     Intersection isect;
     Interaction interact;
     Spectrum L_out = Spectrum();
@@ -463,7 +544,10 @@ namespace CGL {
     // If no intersection occurs, we simply return black.
     // This changes if you implement hemispherical lighting for extra credit.
 
-    if (!bvh->intersect(r, &isect)) {
+    if (primary) {
+      isect = primary -> isect;
+    }
+    else if (!bvh->intersect(r, &isect)) {
       isect.t = INF_D;
       // return envLight ? envLight -> sample_dir(r) : L_out;
       // return L_out;
@@ -486,13 +570,15 @@ namespace CGL {
     // Here we estimate the radiance of the ray which just came out from the 
     // camera freshly. Sample the distance of the first interaction (reflection/
     // /scattering) here.
+    // Each distance sample estimates the whole pixel, so the paths start
+    // with unit throughput for sample_continuations.
     for (size_t i = 0; i < ns_dist; i++) {
       float pdf;
-      DistanceSampler1D* distanceSampler = new DistanceSampler1D(&pos2extinction, space_step);
-      distanceSampler -> set_ray(&r);
-      distanceSampler -> set_max_t(isect.t + EPS_F);
-      double sampled_dist = distanceSampler -> get_sample(&pdf);
-      delete distanceSampler;
+      const Medium* collision_medium;
+      DistanceSampler1D distanceSampler(medium);
+      distanceSampler.set_ray(&r);
+      distanceSampler.set_max_t(isect.t + EPS_F);
+      double sampled_dist = distanceSampler.get_sample(&pdf, &collision_medium);
       // std::cout << "isect: " << isect.t << std::endl;
 
       // if sampled distance is no less than the distance to the nearest surface, 
@@ -502,11 +588,20 @@ namespace CGL {
         // std::cout << "reflect " << sampled_dist << " " << isect.t << std::endl;
   
         interact.interacted = false;
+        // the bounces draw their random numbers before the emission's
+        Spectrum L_direct;
+        Spectrum L_bounced = at_least_one_bounce_radiance<kStrategy>(
+          r, isect, interact, 1., components ? &L_direct : NULL);
+        Spectrum L_zero = zero_bounce_radiance(r, isect, interact);
         Spectrum to_add = 1. / double(ns_dist) *
         // Spectrum to_add = 1. / double(ns_dist) * pre_pdf / pdf *
-          (zero_bounce_radiance(r, isect, interact) + 
-          at_least_one_bounce_radiance(r, isect, interact));
+          (L_zero + L_bounced);
         L_out += to_add;
+        if (components) {
+          components -> emission += 1. / double(ns_dist) * L_zero;
+          components -> direct += 1. / double(ns_dist) * L_direct;
+          components -> indirect += 1. / double(ns_dist) * (L_bounced - L_direct);
+        }
         // std::cout << "reflect " << to_add << std::endl;
       }
       // if sampled distance is no less than the distance to the nearest surface, 
@@ -514,17 +609,17 @@ namespace CGL {
         // std::cout << "scatter " << sampled_dist << std::endl;
         
         interact.interacted = true;
+        interact.medium = collision_medium;
         Vector3D next_ita_point = r.o + r.d * sampled_dist;
-        SchlickPhase *phase_pos = new SchlickPhase(pos2phase(next_ita_point));
-        
         interact.t = sampled_dist;
         r.max_t = sampled_dist;
         interact.n = -r.d;
-        interact.phase = phase_pos;
+        interact.set_phase(collision_medium, next_ita_point);
         Spectrum to_add = 1. / double(ns_dist) * 
           (zero_bounce_radiance(r, isect, interact) + 
-          at_least_one_bounce_radiance(r, isect, interact));
+          at_least_one_bounce_radiance<kStrategy>(r, isect, interact, 1.));
         L_out += to_add;
+        if (components) components -> volume += to_add;
       }
     }
 
@@ -533,7 +628,41 @@ namespace CGL {
     return L_out;
   }
 
-  Spectrum PathTracer::raytrace_pixel(size_t x, size_t y, bool useThinLens) {
+  PrimaryHit PathTracer::trace_primary(Ray& r) {
+    PrimaryHit primary;
+    primary.hit = bvh -> intersect(r, &primary.isect);
+    return primary;
+  }
+
+  void PathTracer::record_features(size_t index, Ray r, const PrimaryHit* primary) {
+    // the features describe the first surface, through any media
+    PrimaryHit traced;
+    if (!primary) {
+      traced.hit = bvh -> intersect(r, &traced.isect);
+      primary = &traced;
+    }
+    if (!primary -> hit) return;
+    const Intersection& isect = primary -> isect;
+
+    // face the camera, so that both sides of a surface look alike
+    Vector3D n = dot(isect.n, r.d) > 0 ? -isect.n : isect.n;
+    Matrix3x3 o2w;
+    make_coord_space(o2w, isect.n);
+    Vector3D w_out = o2w.T() * (-r.d);
+
+    // a one sample estimate of the directional albedo, averaged over the
+    // pixel's samples; it is exact for diffuse and delta BSDFs
+    Vector3D w_in;
+    float pdf;
+    Spectrum f = isect.bsdf -> sample_f(w_out, &w_in, &pdf);
+    if (pdf > 0)
+      albedoSumBuffer[index] += f * (abs_cos_theta(w_in) / pdf);
+    normalSumBuffer[index] += n;
+    depthSumBuffer[index] += isect.t;
+  }
+
+  template <bool kJitter, bool kReuseHits>
+  Spectrum PathTracer::raytrace_pixel(size_t x, size_t y, size_t num_samples) {
     // TODO (Part 1.1):
     // Make a loop that generates num_samples camera rays and traces them 
     // through the scene. Return the average Spectrum. 
@@ -542,65 +671,91 @@ namespace CGL {
     // TODO (Part 5):
     // Modify your implementation to include adaptive sampling.
     // Use the command line parameters "samplesPerBatch" and "maxTolerance"
+    // (the pass scheduler in pathtracer.cpp decides how many samples each
+    // pixel gets; this adds them to the pixel's running sums)
 
-    int num_samples = ns_aa;            // total samples to evaluate
+    size_t index = x + y * sampleBuffer.w;
+    pixel_estimate = sampleCountBuffer[index] ? illumSumBuffer[index] / sampleCountBuffer[index] : 0.;
     Vector2D origin = Vector2D(double(x),double(y));    // bottom left corner of the pixel
     double width = double(sampleBuffer.w);
     double height = double(sampleBuffer.h);
-    
+
     Spectrum radiance_sum = Spectrum(0, 0, 0);
+    double s1 = 0;
+    double s2 = 0;
     // max_ray_depth = 4;
-
-    if (ns_aa == 1) {
-      Vector2D p = origin + Vector2D(.5, .5);
-      Ray ray = camera -> generate_ray(p.x / width, p.y / height);
-      ray.depth = max_ray_depth;
-      Spectrum radiance_in = est_radiance_global_illumination(ray);
-      radiance_sum += radiance_in;
-      
-      sampleCountBuffer[x + y * frameBuffer.w] = 1;
-      return radiance_sum;
-    }
-    else {
-      int i;
-      double n;
-      double s1 = 0;
-      double s2 = 0;
-
-      for (i = 0; i != num_samples; i++) {
-        Vector2D p = origin + gridSampler -> get_sample();
-
+    RadianceComponents* components = componentSumBuffer.empty() ? NULL : &componentSumBuffer[index];
+
+    for (size_t j = 0; j < num_samples; j++) {
+      // continue the pixel's sample sequence where the last pass left it
+      size_t i = sampleCountBuffer[index] + j;
+
+      // the first dimensions of each sample go to the pixel and the lens
+      seed_random(index, i, seed);
+      if (current_sample_generator)
+        current_sample_generator->start_pixel_sample(x, y, i);
+
+      Vector2D p;
+      size_t position = 0;
+      if (kReuseHits) {
+        // revisit the pixel's fixed positions in turn
+        position = kJitter ? i % primaryHits -> num_positions() : 0;
+        p = origin + (kJitter ? primaryHits -> offset(x, y, position) : Vector2D(.5, .5));
+      } else if (!kJitter) {
+        p = origin + Vector2D(.5, .5);
+      } else {
+        p = origin + gridSampler -> get_sample();
         Vector2D samplesForLens = gridSampler -> get_sample();
         // Ray ray = camera -> generate_ray_for_thin_lens(
         //   p.x / width, p.y / height, 
         //   samplesForLens.x, samplesForLens.y * 2.0 * PI);
-        
-        Ray ray = camera -> generate_ray(p.x / width, p.y / height);
-        
-        ray.depth = max_ray_depth;
-        Spectrum radiance_in = est_radiance_global_illumination(ray);
-        radiance_sum += radiance_in;
-        
-        //////////////////////////////////////////////////
-        double illum_in = radiance_in.illum();
-        s1 += illum_in;
-        s2 = s2 + illum_in * illum_in;
-
-        if ((i + 1) % samplesPerBatch == 0) {
-          n = i + 1;
-          double myu = s1 / n;
-          double sigma2 = (s2 - s1 * s1 / n) / (n - 1);
-          double I = 1.96 * sqrt(sigma2 / n);
-          if (I <= maxTolerance * myu)
-            break;
+      }
+
+      Ray ray = camera -> generate_ray(p.x / width, p.y / height);
+
+      ray.depth = max_ray_depth;
+      Spectrum radiance_in;
+      const PrimaryHit* primary = NULL;
+      if (kReuseHits) {
+        primary = primaryHits -> lookup(index, position);
+        if (primary) {
+          if (primary -> hit) ray.max_t = primary -> isect.t;
+        } else {
+          primary = primaryHits -> store(index, position, trace_primary(ray));
         }
-        //////////////////////////////////////////////////
+        radiance_in = integrator -> radiance(ray, *primary, components);
+      } else {
+        radiance_in = integrator -> radiance(ray, components);
       }
-      sampleCountBuffer[x + y * frameBuffer.w] = i;
-      return radiance_sum / (i);
+      // after the radiance, whose random numbers the features leave alone
+      if (recordFeatures)
+        record_features(index, camera -> generate_ray(p.x / width, p.y / height), primary);
+      radiance_sum += radiance_in;
+
+      double illum_in = radiance_in.illum();
+      s1 += illum_in;
+      s2 = s2 + illum_in * illum_in;
     }
+
+    radianceSumBuffer[index] += radiance_sum;
+    illumSumBuffer[index] += s1;
+    illumSqSumBuffer[index] += s2;
+    sampleCountBuffer[index] += num_samples;
+    return radianceSumBuffer[index] / sampleCountBuffer[index];
   }
 
+  // the kernels create_integrator and start_raytracing pick from
+  template Spectrum PathTracer::est_radiance_global_illumination<kHemisphereSampling>(
+    Ray &r, const PrimaryHit* primary, RadianceComponents* components);
+  template Spectrum PathTracer::est_radiance_global_illumination<kLightSampling>(
+    Ray &r, const PrimaryHit* primary, RadianceComponents* components);
+  template Spectrum PathTracer::est_radiance_global_illumination<kDeltaLightSampling>(
+    Ray &r, const PrimaryHit* primary, RadianceComponents* components);
+  template Spectrum PathTracer::raytrace_pixel<false, false>(size_t x, size_t y, size_t num_samples);
+  template Spectrum PathTracer::raytrace_pixel<true, false>(size_t x, size_t y, size_t num_samples);
+  template Spectrum PathTracer::raytrace_pixel<false, true>(size_t x, size_t y, size_t num_samples);
+  template Spectrum PathTracer::raytrace_pixel<true, true>(size_t x, size_t y, size_t num_samples);
+
   // Spectrum PathTracer::raytrace_pixel(size_t x, size_t y, bool useThinLens) {
   //   // TODO (Part 1.1):
   //   // Make a loop that generates num_samples camera rays and traces them 
@@ -681,6 +836,10 @@ namespace CGL {
     return f(wo, *wi);
   }
 
+  float DiffuseBSDF::pdf(const Vector3D& wo, const Vector3D& wi) {
+    return wi.z > 0 ? wi.z / PI : 0.;
+  }
+
   // Camera //
   Ray Camera::generate_ray(double x, double y) const {
     // TODO (Part 1.2):
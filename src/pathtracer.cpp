@@ -8,11 +8,13 @@
 #include <random>
 #include <algorithm>
 #include <sstream>
+#include <map>
 
 #include "CGL/CGL.h"
 #include "CGL/vector3D.h"
 #include "CGL/matrix3x3.h"
 #include "CGL/lodepng.h"
+#include "CGL/tinyexr.h"
 
 #include "GL/glew.h"
 
@@ -28,6 +30,66 @@ using std::max;
 
 namespace CGL {
 
+namespace {
+
+// Writes buffer, whose first row is the bottom of the image, to a png file.
+void write_png(const string& filename, const ImageBuffer& buffer) {
+  const uint32_t* frame = &buffer.data[0];
+  size_t w = buffer.w;
+  size_t h = buffer.h;
+  uint32_t* frame_out = new uint32_t[w * h];
+  for(size_t i = 0; i < h; ++i) {
+    memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
+  }
+  
+  for (size_t i = 0; i < w * h; ++i) {
+    frame_out[i] |= 0xFF000000;
+  }
+
+  lodepng::encode(filename, (unsigned char*) frame_out, w, h);
+  
+  delete[] frame_out;
+}
+
+// AOVs the renderer can write, in the order "all" lists them.
+const char* const kAOVNames[] = {
+  "emission", "direct", "indirect", "volume", "albedo", "normal", "depth", "samples"
+};
+
+typedef std::map<string, vector<float> > EXRChannels;
+
+// Adds values, whose first row is the bottom of the image, to channels as
+// the channels layer + names[c], flipped to run top down.
+void add_exr_layer(EXRChannels* channels, const string& layer,
+                   const char* const names[3], const vector<Spectrum>& values,
+                   size_t w, size_t h) {
+  vector<float>* c[3];
+  for (int k = 0; k < 3; k++) {
+    c[k] = &(*channels)[layer + names[k]];
+    c[k]->resize(w * h);
+  }
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      const Spectrum& s = values[x + (h - 1 - y) * w];
+      (*c[0])[x + y * w] = s.r;
+      (*c[1])[x + y * w] = s.g;
+      (*c[2])[x + y * w] = s.b;
+    }
+  }
+}
+
+// Adds values to channels as the single channel name, like add_exr_layer.
+void add_exr_channel(EXRChannels* channels, const string& name,
+                     const vector<float>& values, size_t w, size_t h) {
+  vector<float>& c = (*channels)[name];
+  c.resize(w * h);
+  for (size_t y = 0; y < h; y++)
+    for (size_t x = 0; x < w; x++)
+      c[x + y * w] = values[x + (h - 1 - y) * w];
+}
+
+} // namespace
+
 PathTracer::PathTracer(size_t ns_aa,
                        size_t max_ray_depth,
                        size_t ns_area_light,
@@ -41,7 +103,26 @@ PathTracer::PathTracer(size_t ns_aa,
                        bool direct_hemisphere_sample,
                        string filename,
                        double lensRadius,
-                       double focalDistance){
+                       double focalDistance,
+                       string envmap_path,
+                       bool envmap_debug,
+                       string sample_generator,
+                       size_t seed,
+                       double max_render_time,
+                       bool progressive,
+                       double snapshot_interval,
+                       bool adjoint_rr,
+                       bool guiding,
+                       string integrator,
+                       size_t primary_hit_pattern,
+                       bool denoise,
+                       string aovs,
+                       bool irradiance_cache,
+                       string medium,
+                       bool medium_bricks,
+                       bool ratio_tracking,
+                       string homogeneous_medium,
+                       size_t noise_cache){
   state = INIT,
   this->ns_aa = ns_aa;
   this->max_ray_depth = max_ray_depth;
@@ -55,9 +136,26 @@ PathTracer::PathTracer(size_t ns_aa,
   this->focalDistance = focalDistance;
   this->direct_hemisphere_sample = direct_hemisphere_sample;
   this->filename = filename;
+  this->seed = seed;
+  this->maxRenderTime = max_render_time;
+  this->progressive = progressive;
+  this->snapshotInterval = snapshot_interval;
+  this->adjointRR = adjoint_rr;
+  this->guiding = guiding;
+  this->integratorName = integrator;
+
+  SampleGenerator* generator = create_sample_generator(sample_generator, ns_aa);
+  if (generator) {
+    this->sampleGeneratorName = sample_generator;
+  } else {
+    fprintf(stdout, "[PathTracer] Unknown sample generator %s, using sobol\n",
+            sample_generator.c_str());
+    this->sampleGeneratorName = "sobol";
+  }
+  delete generator;
 
   if (envmap) {
-    this->envLight = new EnvironmentLight(envmap);
+    this->envLight = new EnvironmentLight(envmap, envmap_path, envmap_debug);
   } else {
     this->envLight = NULL;
   }
@@ -68,14 +166,64 @@ PathTracer::PathTracer(size_t ns_aa,
 
   gridSampler = new UniformGridSampler2D();
   hemisphereSampler = new UniformHemisphereSampler3D();
+  radianceCache = adjoint_rr ? new RadianceCache() : NULL;
+  guidingField = guiding ? new GuidingField() : NULL;
+  primaryHits = primary_hit_pattern ? new PrimaryHitCache(primary_hit_pattern) : NULL;
+  irradianceCache = irradiance_cache ? new IrradianceCache() : NULL;
+  this->medium = NULL;
+  if (medium_bricks && !medium.empty()) {
+    BrickMedium* bricks = BrickMedium::load(medium);
+    if (bricks) {
+      fprintf(stdout, "[PathTracer] Loaded medium %s into %zu bricks\n",
+              medium.c_str(), bricks->num_bricks());
+    }
+    this->medium = bricks;
+  } else if (!medium.empty()) {
+    this->medium = GridMedium::load(medium);
+  }
+  if (!medium.empty() && !this->medium) {
+    fprintf(stdout, "[PathTracer] Could not load medium %s, using the cloud\n",
+            medium.c_str());
+  }
+  if (!medium.empty() && !homogeneous_medium.empty()) {
+    fprintf(stdout, "[PathTracer] Ignoring homogeneous medium %s, as medium %s is given\n",
+            homogeneous_medium.c_str(), medium.c_str());
+  }
+  if (medium.empty() && !homogeneous_medium.empty()) {
+    this->medium = HomogeneousMedium::parse(homogeneous_medium);
+    if (!this->medium) {
+      fprintf(stdout, "[PathTracer] Could not parse homogeneous medium %s, using the cloud\n",
+              homogeneous_medium.c_str());
+    }
+  }
+  mediumGiven = this->medium != NULL;
+  noiseCache = noise_cache << 20;
+  if (!this->medium) this->medium = new CloudMedium(noiseCache);
+  residualTracking = !ratio_tracking;
+  this->integrator = NULL;
+  denoiser = denoise ? new Denoiser() : NULL;
+
+  stringstream aovList(aovs);
+  string aov;
+  while (getline(aovList, aov, ',')) {
+    if (aov == "all") {
+      this->aovs.assign(std::begin(kAOVNames), std::end(kAOVNames));
+    } else if (std::find(std::begin(kAOVNames), std::end(kAOVNames), aov) != std::end(kAOVNames)) {
+      if (!has_aov(aov)) this->aovs.push_back(aov);
+    } else if (!aov.empty()) {
+      fprintf(stdout, "[PathTracer] Unknown AOV %s\n", aov.c_str());
+    }
+  }
+  recordFeatures = denoise || has_aov("albedo") || has_aov("normal") || has_aov("depth");
+  this->pixelKernel = &PathTracer::raytrace_pixel<true, false>;
 
   ns_dist = 48;
-  space_step = 0.5;
 
   phase = new SchlickPhase(Spectrum(-0.5, -0.5, 0.5));
   sphereSampler = new UniformSphereSampler3D();
 
   show_rays = true;
+  render_silent = false;
 
   imageTileSize = 32;
   numWorkerThreads = num_threads;
@@ -93,147 +241,18 @@ PathTracer::~PathTracer() {
   delete bvh;
   delete gridSampler;
   delete hemisphereSampler;
+  delete radianceCache;
+  delete guidingField;
+  delete primaryHits;
+  delete irradianceCache;
+  delete medium;
+  delete denoiser;
+  delete integrator;
   delete phase;
   delete sphereSampler;
 
 }
 
-// Spectrum PathTracer::pos2phase(const Vector3D& pos) {
-//   return Spectrum(0.5, 0.5, 0.5);
-// }
-
-// kumo and sora
-Spectrum PathTracer::pos2phase(const Vector3D& pos) {
-  double x = pos.x, y = pos.y, z = pos.z;
-
-  // double a = 20.;
-  // double u = random_uniform(); double v = random_uniform(); double w = random_uniform();
-  // double noise_r = - log(1. / u - 1.) / a;
-  // double noise_g = - log(1. / v - 1.) / a;
-  // double noise_b = - log(1. / w - 1.) / a;
-
-  double noise_r = 0., noise_g = 0., noise_b = 0.;
-
-  // cout << "noise below" << endl;
-  // cout << noise_r << " " << noise_g << " " << noise_b << endl;
-
-  // if (pos.x > -0.5 && pos.x < 0.5
-  //   && pos.x > -0.5 && pos.x < 0.5
-  //   && pos.x > -5.5 && pos.x < -3.5) {
-  if ((pow(x, 2.) / 1.5 + pow(y, 2.) / 0.25 + pow((z + 4.), 2.) / 2.0 < 1.)
-    || (pow(x - .85, 2.) / 0.75 + pow(y, 2.) / 0.125 + pow((z + 4.), 2.) / 1.0 < 1.)
-    || (pow(x + .8, 2.) / 0.75 + pow(y + .25, 2.) / 0.125 + pow((z + 4.), 2.) / 1.0 < 1.)) {
-    // cout << pos << endl;
-    // return Spectrum(.8, .8, -.9); // kumo
-    Spectrum rtr = Spectrum(
-      clamp(.5 + noise_r, -1., 1.), 
-      clamp(.5 + noise_g, -1., 1.), 
-      clamp(-.5 + noise_b, -1., 1.)); // kumo
-    return rtr;
-  }
-
-  else {
-    // double bias = 2.5 / (pow((x - 1.), 2.) + pow((y - 1.), 2.) + pow((z + 3.), 2.));
-    double bias = 0.;
-    Spectrum rtr = Spectrum(
-      clamp(-.5 + bias + noise_r, -1., 1.), 
-      clamp(-.5 + bias + noise_g, -1., 1.), 
-      clamp(.9 + - bias + noise_b, -1., 1.)); // sora
-    return rtr;
-    // return Spectrum(-0.5, -0.5, 0.5); //sora
-  }
-}
-
-// // rainbow
-// Spectrum PathTracer::pos2phase(const Vector3D& pos) {
-//   double x = pos.x, y = pos.y, z = pos.z;
-
-//   // double a = 20.;
-//   // double u = random_uniform(); double v = random_uniform(); double w = random_uniform();
-//   // double noise_r = - log(1. / u - 1.) / a;
-//   // double noise_g = - log(1. / v - 1.) / a;
-//   // double noise_b = - log(1. / w - 1.) / a;
-
-//   double noise_r = 0., noise_g = 0., noise_b = 0.;
-
-//   double bias = 3.5 / (pow((x - 1.), 2.) + pow((y - 1.), 2.) + pow((z + 3.), 2.));
-//   // double bias = 0.;
-//   // cout << bias << endl;
-//   Spectrum rtr = Spectrum(
-//     clamp((-.7 + 1.4 * bias + noise_r), -1., 1.), 
-//     clamp((-.3 + 1.2 * bias + noise_g), -1., 1.), 
-//     clamp((.9 - bias + noise_b), -1., 1.)); // sora
-//   return rtr;
-//   // return Spectrum(-0.5, -0.5, 0.5); //sora
-  
-// }
-
-// double PathTracer::pos2extinction(const Vector3D& pos) {
-//   return 0.1; // for kumo and sora
-//   // return 0.25; // for bunny in the room
-// }
-
-double PathTracer::pos2extinction(const Vector3D& pos) {
-  double x = pos.x, y = pos.y, z = pos.z;
-
-  double a = 100.;
-  double u = random_uniform();
-  double noise = - log(1. / u - 1.) / a;
-
-  // double noise = 0.;
-
-  // cout << "noise below" << endl;
-  // cout << noise << endl;
-
-  // if (pos.x > -0.5 && pos.x < 0.5
-  //   && pos.x > -0.5 && pos.x < 0.5
-  //   && pos.x > -5.5 && pos.x < -3.5) {
-  if ((pow(x, 2.) / 1.5 + pow(y, 2.) / 0.25 + pow((z + 4.), 2.) / 2.0 < 1.)
-    || (pow(x - .85, 2.) / 0.75 + pow(y, 2.) / 0.125 + pow((z + 4.), 2.) / 1.0 < 1.)
-    || (pow(x + .8, 2.) / 0.75 + pow(y + .25, 2.) / 0.125 + pow((z + 4.), 2.) / 1.0 < 1.)) {
-    return 0.3 + noise;
-  }
-
-  else {
-    // double bias = 2.5 / (pow((x - 1.), 2.) + pow((y - 1.), 2.) + pow((z + 3.), 2.));
-    double bias = 0.;
-    return 0.1 + bias;
-  }
-}
-
-// double PathTracer::pos2scattering(const Vector3D& pos) {
-//   return 0.2; // for kumo and sora
-//   // return 2.5; // for bunny in the room
-// }
-
-double PathTracer::pos2scattering(const Vector3D& pos) {
-  double x = pos.x, y = pos.y, z = pos.z;
-
-  double a = 100.;
-  double u = random_uniform();
-  double noise = - log(1. / u - 1.) / a;
-
-  // double noise = 0.;
-
-  // cout << "noise below" << endl;
-  // cout << noise << endl;
-
-  // if (pos.x > -0.5 && pos.x < 0.5
-  //   && pos.x > -0.5 && pos.x < 0.5
-  //   && pos.x > -5.5 && pos.x < -3.5) {
-  if ((pow(x, 2.) / 1.5 + pow(y, 2.) / 0.25 + pow((z + 4.), 2.) / 2.0 < 1.)
-    || (pow(x - .85, 2.) / 0.75 + pow(y, 2.) / 0.125 + pow((z + 4.), 2.) / 1.0 < 1.)
-    || (pow(x + .8, 2.) / 0.75 + pow(y + .25, 2.) / 0.125 + pow((z + 4.), 2.) / 1.0 < 1.)) {
-    return 0.6 + noise;
-  }
-
-  else {
-    // double bias = 2.5 / (pow((x - 1.), 2.) + pow((y - 1.), 2.) + pow((z + 3.), 2.));
-    double bias = 0.;
-    return 0.2 + bias;
-  }
-}
-
 void PathTracer::set_scene(Scene *scene) {
 
   if (state != INIT) {
@@ -252,6 +271,7 @@ void PathTracer::set_scene(Scene *scene) {
 
   this->scene = scene;
   build_accel();
+  if (primaryHits) primaryHits->invalidate();
 
   if (has_valid_configuration()) {
     state = READY;
@@ -285,6 +305,15 @@ void PathTracer::set_frame_size(size_t width, size_t height) {
   cell_br = Vector2D(width, height);
   render_cell = false;
   sampleCountBuffer.resize(width * height);
+  radianceSumBuffer.resize(width * height);
+  illumSumBuffer.resize(width * height);
+  illumSqSumBuffer.resize(width * height);
+  albedoSumBuffer.resize(width * height);
+  normalSumBuffer.resize(width * height);
+  depthSumBuffer.resize(width * height);
+  bool components = has_aov("emission") || has_aov("direct") ||
+                    has_aov("indirect") || has_aov("volume");
+  componentSumBuffer.resize(components ? width * height : 0);
   if (has_valid_configuration()) {
     state = READY;
   }
@@ -349,6 +378,7 @@ void PathTracer::clear() {
   bvh = NULL;
   scene = NULL;
   camera = NULL;
+  if (primaryHits) primaryHits->invalidate();
   selectionHistory.pop();
   sampleBuffer.resize(0, 0);
   frameBuffer.resize(0, 0);
@@ -380,19 +410,27 @@ void PathTracer::start_raytracing() {
   workerDoneCount = 0;
 
   sampleBuffer.clear();
+  std::fill(sampleCountBuffer.begin(), sampleCountBuffer.end(), 0);
+  std::fill(radianceSumBuffer.begin(), radianceSumBuffer.end(), Spectrum());
+  std::fill(illumSumBuffer.begin(), illumSumBuffer.end(), 0.);
+  std::fill(illumSqSumBuffer.begin(), illumSqSumBuffer.end(), 0.);
+  std::fill(albedoSumBuffer.begin(), albedoSumBuffer.end(), Spectrum());
+  std::fill(normalSumBuffer.begin(), normalSumBuffer.end(), Vector3D());
+  std::fill(depthSumBuffer.begin(), depthSumBuffer.end(), 0.);
+  std::fill(componentSumBuffer.begin(), componentSumBuffer.end(), RadianceComponents());
+
+  passTiles.clear();
   if (!render_cell) {
     frameBuffer.clear();
     num_tiles_w = sampleBuffer.w / imageTileSize + 1;
     num_tiles_h = sampleBuffer.h / imageTileSize + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
     tile_samples.resize(num_tiles_w * num_tiles_h);
     memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
 
-    // populate the tile work queue
+    // the tiles every pass picks from
     for (size_t y = 0; y < sampleBuffer.h; y += imageTileSize) {
         for (size_t x = 0; x < sampleBuffer.w; x += imageTileSize) {
-            workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+            passTiles.push_back(WorkItem(x, y, imageTileSize, imageTileSize));
         }
     }
   } else {
@@ -401,20 +439,47 @@ void PathTracer::start_raytracing() {
     int imTS = imageTileSize / 4;
     num_tiles_w = w / imTS + 1;
     num_tiles_h = h / imTS + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
     tile_samples.resize(num_tiles_w * num_tiles_h);
     memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
 
-    // populate the tile work queue
+    // the tiles every pass picks from
     for (size_t y = cell_tl.y; y < cell_br.y; y += imTS) {
       for (size_t x = cell_tl.x; x < cell_br.x; x += imTS) {
-        workQueue.put_work(WorkItem(x, y, 
+        passTiles.push_back(WorkItem(x, y, 
           min(imTS, (int)(cell_br.x-x)), min(imTS, (int)(cell_br.y-y)) ));
       }
     }
   }
 
+  passIndex = 0;
+  passArrived = 0;
+  passGeneration = 0;
+  renderTimer.start();
+  if (radianceCache) radianceCache->reset(bvh->get_bbox());
+  if (guidingField) guidingField->reset(bvh->get_bbox());
+  if (irradianceCache) irradianceCache->reset(bvh->get_bbox());
+  delete integrator;
+  integrator = create_integrator(integratorName, this);
+  if (!integrator) {
+    fprintf(stdout, "[PathTracer] Unknown integrator %s, using volpath\n",
+            integratorName.c_str());
+    integrator = create_integrator("volpath", this);
+  }
+  // jittering and hit reuse are decided once per render like the
+  // integrator, so that the pixel loop does not test for them at every sample
+  if (primaryHits) {
+    primaryHits->validate(*camera, sampleBuffer.w, sampleBuffer.h, seed);
+    pixelKernel = ns_aa > 1 ? &PathTracer::raytrace_pixel<true, true>
+                            : &PathTracer::raytrace_pixel<false, true>;
+  } else {
+    pixelKernel = ns_aa > 1 ? &PathTracer::raytrace_pixel<true, false>
+                            : &PathTracer::raytrace_pixel<false, false>;
+  }
+  passStartTime = 0.;
+  passStartSamples = 0;
+  lastSnapshotTime = 0.;
+  passesDone = !schedule_pass();
+
   bvh->total_isects = 0; bvh->total_rays = 0;
   // launch threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
@@ -425,13 +490,17 @@ void PathTracer::start_raytracing() {
 
 void PathTracer::render_to_file(string filename, size_t x, size_t y, size_t dx, size_t dy) {
   if (x == -1) {
+    outputFilename = filename;
     unique_lock<std::mutex> lk(m_done);
     start_raytracing();
     cv_done.wait(lk, [this]{ return state == DONE; });
     lk.unlock();
     save_image(filename);
+    if (snapshotInterval > 0 || !aovs.empty())
+      save_hdr_image(filename.substr(0, filename.find_last_of('.')) + ".exr");
     fprintf(stdout, "[PathTracer] Job completed.\n");
   } else {
+    outputFilename = "";
     render_cell = true;
     cell_tl = Vector2D(x,y);
     cell_br = Vector2D(x+dx,y+dy);
@@ -449,14 +518,34 @@ void PathTracer::build_accel() {
   fprintf(stdout, "[PathTracer] Collecting primitives... "); fflush(stdout);
   timer.start();
   vector<Primitive *> primitives;
+  vector<Primitive *> boundaries;  // surfaces of the objects' media
+  size_t num_media = 0;
   for (SceneObject *obj : scene->objects) {
     const vector<Primitive *> &obj_prims = obj->get_primitives();
-    primitives.reserve(primitives.size() + obj_prims.size());
-    primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+    vector<Primitive *> &dest = obj->get_medium() ? boundaries : primitives;
+    if (obj->get_medium()) num_media++;
+    dest.reserve(dest.size() + obj_prims.size());
+    dest.insert(dest.end(), obj_prims.begin(), obj_prims.end());
   }
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
 
+  // fill the objects with their media, unless one was given, in which case
+  // they are kept as plain surfaces of their own BSDF //
+  if (num_media && mediumGiven) {
+    fprintf(stdout, "[PathTracer] Ignoring the media of %zu objects, rendering them as surfaces\n",
+            num_media);
+    primitives.insert(primitives.end(), boundaries.begin(), boundaries.end());
+  } else if (!mediumGiven) {
+    delete medium;
+    if (num_media) {
+      fprintf(stdout, "[PathTracer] Filling %zu objects with their media\n", num_media);
+      medium = new InterfaceMedium(boundaries);
+    } else {
+      medium = new CloudMedium(noiseCache);
+    }
+  }
+
   // build BVH //
   fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size()); 
   fflush(stdout);
@@ -687,7 +776,7 @@ void PathTracer::key_press(int key) {
 }
 
 void PathTracer::raytrace_tile(int tile_x, int tile_y,
-                               int tile_w, int tile_h) {
+                               int tile_w, int tile_h, int num_samples) {
 
   size_t w = sampleBuffer.w;
   size_t h = sampleBuffer.h;
@@ -705,9 +794,10 @@ void PathTracer::raytrace_tile(int tile_x, int tile_y,
   for (size_t y = tile_start_y; y < tile_end_y; y++) {
     if (!continueRaytracing) return;
     for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      // TODO: 4.0
-      // Change from false to true to enable thin lens
-      Spectrum s = raytrace_pixel(x, y, false);
+      size_t index = x + y * w;
+      if (pixel_converged(index)) continue;
+      size_t n = min<size_t>(num_samples, ns_aa - sampleCountBuffer[index]);
+      Spectrum s = (this->*pixelKernel)(x, y, n);
       sampleBuffer.update_pixel(s, x, y);
     }
   }
@@ -749,16 +839,28 @@ void PathTracer::worker_thread() {
   Timer timer;
   timer.start();
 
+  // samplers on this thread draw from the generator, sized for the current
+  // sample count
+  SampleGenerator* generator =
+    create_sample_generator(sampleGeneratorName, ns_aa, seed);
+  current_sample_generator = generator;
+
   WorkItem work;
-  while (continueRaytracing && workQueue.try_get_work(&work)) {
-    raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
-    { 
-      lock_guard<std::mutex> lk(m_done);
-      ++tilesDone;
-      if (!render_silent)  cout << "\r[PathTracer] Rendering... " << int((double)tilesDone/tilesTotal * 100) << '%';
-      cout.flush();
+  do {
+    while (continueRaytracing && workQueue.try_get_work(&work)) {
+      raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h,
+                    work.num_samples);
+      { 
+        lock_guard<std::mutex> lk(m_done);
+        ++tilesDone;
+        if (!render_silent)  cout << "\r[PathTracer] Rendering... pass " << passIndex << ": " << int((double)tilesDone/tilesTotal * 100) << '%';
+        cout.flush();
+      }
     }
-  }
+  } while (wait_for_next_pass());
+
+  current_sample_generator = NULL;
+  delete generator;
 
   workerDoneCount++;
   if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
@@ -772,6 +874,7 @@ void PathTracer::worker_thread() {
     if (!render_silent)  fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
     if (!render_silent)  fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
     if (!render_silent)  fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+    if (denoiser) denoise();
 
     lock_guard<std::mutex> lk(m_done);
     state = DONE;
@@ -779,6 +882,149 @@ void PathTracer::worker_thread() {
   }
 }
 
+double PathTracer::pixel_error(size_t index) const {
+  int n = sampleCountBuffer[index];
+  if (n < 2) return 1.;
+  double mu = illumSumBuffer[index] / n;
+  double sigma2 = max(0., (illumSqSumBuffer[index] - illumSumBuffer[index] * mu) / (n - 1));
+  // the small floor keeps near black pixels from soaking up the whole budget
+  return 1.96 * sqrt(sigma2 / n) / (mu + 1e-3);
+}
+
+bool PathTracer::pixel_converged(size_t index) const {
+  int n = sampleCountBuffer[index];
+  return n >= (int)ns_aa || (n >= 2 && pixel_error(index) <= maxTolerance);
+}
+
+bool PathTracer::schedule_pass() {
+  size_t w = sampleBuffer.w;
+  size_t h = sampleBuffer.h;
+  vector<WorkItem> work;
+
+  renderTimer.stop();
+  double elapsed = renderTimer.duration();
+  size_t numSamples = 0;
+
+  if (passIndex == 0) {
+    // an even first batch everywhere to get the error estimates going
+    int n = progressive ? 1 : min(samplesPerBatch, ns_aa);
+    for (const WorkItem& tile : passTiles)
+      work.push_back(WorkItem(tile.tile_x, tile.tile_y, tile.tile_w, tile.tile_h, n));
+  } else {
+    // sum up the error of the pixels that still need samples, per tile
+    vector<double> tileError(passTiles.size(), 0.);
+    vector<size_t> tileActive(passTiles.size(), 0);
+    double imageError = 0., activeError = 0.;
+    size_t numPixels = 0, numActive = 0;
+    for (size_t t = 0; t < passTiles.size(); t++) {
+      const WorkItem& tile = passTiles[t];
+      size_t end_x = min<size_t>(tile.tile_x + tile.tile_w, w);
+      size_t end_y = min<size_t>(tile.tile_y + tile.tile_h, h);
+      for (size_t y = tile.tile_y; y < end_y; y++) {
+        for (size_t x = tile.tile_x; x < end_x; x++) {
+          size_t index = x + y * w;
+          double err = pixel_error(index);
+          imageError += err;
+          numPixels++;
+          numSamples += sampleCountBuffer[index];
+          if (!pixel_converged(index)) {
+            tileError[t] += err;
+            tileActive[t]++;
+          }
+        }
+      }
+      activeError += tileError[t];
+      numActive += tileActive[t];
+    }
+    if (numPixels) imageError /= numPixels;
+
+    if (snapshotInterval > 0 && elapsed - lastSnapshotTime >= snapshotInterval) {
+      save_snapshot();
+      lastSnapshotTime = elapsed;
+    }
+
+    const char* reason = NULL;
+    if (numActive == 0)
+      reason = "all pixels converged";
+    else if (imageError <= maxTolerance)
+      reason = "error target met";
+    else if (maxRenderTime > 0 && elapsed >= maxRenderTime)
+      reason = "time limit reached";
+    if (reason) {
+      if (!render_silent)
+        fprintf(stdout, "\r[PathTracer] Stopped after %zu passes, %s (mean error %.4f).\n",
+                passIndex, reason, imageError);
+      return false;
+    }
+
+    // the pass spends a batch per unconverged pixel, split between the
+    // tiles in proportion to their error; the cap keeps the estimates fresh
+    // in progressive mode every pass instead doubles the samples of all
+    // pixels still running, so each pass ends with an evenly sampled image
+    double budget = double(samplesPerBatch) * numActive;
+    int cap = 4 * samplesPerBatch;
+    double planned = 0.;
+    for (size_t t = 0; t < passTiles.size(); t++) {
+      if (!tileActive[t]) continue;
+      int n;
+      if (progressive) {
+        n = int(min<size_t>(size_t(1) << min<size_t>(passIndex - 1, 30), ns_aa));
+      } else {
+        double share = activeError > 0. ? tileError[t] / activeError
+                                        : double(tileActive[t]) / numActive;
+        n = int(budget * share / tileActive[t] + .5);
+        n = max(1, min(n, cap));
+      }
+      planned += double(n) * tileActive[t];
+      const WorkItem& tile = passTiles[t];
+      work.push_back(WorkItem(tile.tile_x, tile.tile_y, tile.tile_w, tile.tile_h, n));
+    }
+
+    // shrink a pass that would run past the time limit, going by the cost
+    // per sample of the pass before
+    if (maxRenderTime > 0 && numSamples > passStartSamples) {
+      double secondsPerSample = (elapsed - passStartTime) / (numSamples - passStartSamples);
+      double scale = (maxRenderTime - elapsed) / (planned * secondsPerSample);
+      if (scale < 1.) {
+        for (WorkItem& tile : work)
+          tile.num_samples = max(1, int(tile.num_samples * scale));
+      }
+    }
+    // start the most expensive tiles first so that the pass ends evenly
+    std::stable_sort(work.begin(), work.end(), [](const WorkItem& a, const WorkItem& b) {
+      return a.num_samples > b.num_samples;
+    });
+  }
+
+  // the next pass steers its paths by what the passes so far learned
+  if (radianceCache) radianceCache->update();
+  if (guidingField) guidingField->update();
+
+  for (const WorkItem& tile : work)
+    workQueue.put_work(tile);
+  tilesTotal = work.size();
+  tilesDone = 0;
+  passIndex++;
+  passStartTime = elapsed;
+  passStartSamples = numSamples;
+  return true;
+}
+
+bool PathTracer::wait_for_next_pass() {
+  unique_lock<std::mutex> lk(m_pass);
+  if (++passArrived < numWorkerThreads) {
+    size_t generation = passGeneration;
+    cv_pass.wait(lk, [this, generation]{ return passGeneration != generation; });
+  } else {
+    // the last worker to finish plans the next pass for everyone
+    passArrived = 0;
+    passesDone = passesDone || !continueRaytracing || !schedule_pass();
+    passGeneration++;
+    cv_pass.notify_all();
+  }
+  return !passesDone;
+}
+
 void PathTracer::save_image(string filename, ImageBuffer* buffer) {
 
   if (state != DONE) return;
@@ -798,27 +1044,120 @@ void PathTracer::save_image(string filename, ImageBuffer* buffer) {
     filename = ss.str();  
   }
 
-  uint32_t* frame = &buffer->data[0];
-  size_t w = buffer->w;
-  size_t h = buffer->h;
-  uint32_t* frame_out = new uint32_t[w * h];
-  for(size_t i = 0; i < h; ++i) {
-    memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
-  }
-  
-  for (size_t i = 0; i < w * h; ++i) {
-    frame_out[i] |= 0xFF000000;
-  }
-
   fprintf(stderr, "[PathTracer] Saving to file: %s... ", filename.c_str());
-  lodepng::encode(filename, (unsigned char*) frame_out, w, h);
+  write_png(filename, *buffer);
   fprintf(stderr, "Done!\n");
-  
-  delete[] frame_out;
 
   save_sampling_rate_image(filename);
 }
 
+void PathTracer::save_hdr_image(string filename) {
+  size_t w = sampleBuffer.w;
+  size_t h = sampleBuffer.h;
+  static const char* const kRGB[3] = {"R", "G", "B"};
+  static const char* const kXYZ[3] = {"X", "Y", "Z"};
+
+  EXRChannels channels;
+  add_exr_layer(&channels, "", kRGB, sampleBuffer.data, w, h);
+
+  // AOVs hold the averages over each pixel's samples
+  for (const string& aov : aovs) {
+    vector<Spectrum> layer(w * h);
+    vector<float> values(w * h);
+    for (size_t i = 0; i < w * h; i++) {
+      int count = sampleCountBuffer[i];
+      if (aov == "samples") values[i] = count;
+      if (!count) continue;
+      if (aov == "emission") layer[i] = componentSumBuffer[i].emission * (1.f / count);
+      if (aov == "direct") layer[i] = componentSumBuffer[i].direct * (1.f / count);
+      if (aov == "indirect") layer[i] = componentSumBuffer[i].indirect * (1.f / count);
+      if (aov == "volume") layer[i] = componentSumBuffer[i].volume * (1.f / count);
+      if (aov == "albedo") layer[i] = albedoSumBuffer[i] * (1.f / count);
+      if (aov == "depth") values[i] = depthSumBuffer[i] / count;
+      if (aov == "normal") {
+        Vector3D n = normalSumBuffer[i];
+        double len = n.norm();
+        if (len > 0) n /= len;
+        layer[i] = Spectrum(n.x, n.y, n.z);
+      }
+    }
+    if (aov == "samples")
+      add_exr_channel(&channels, aov, values, w, h);
+    else if (aov == "depth")
+      add_exr_channel(&channels, aov + ".Z", values, w, h);
+    else
+      add_exr_layer(&channels, aov + ".", aov == "normal" ? kXYZ : kRGB, layer, w, h);
+  }
+
+  // OpenEXR keeps channels sorted by name, as the map does
+  vector<const char*> names;
+  vector<unsigned char*> images;
+  vector<int> types;
+  for (EXRChannels::iterator it = channels.begin(); it != channels.end(); ++it) {
+    names.push_back(it->first.c_str());
+    images.push_back((unsigned char*) it->second.data());
+    types.push_back(TINYEXR_PIXELTYPE_FLOAT);
+  }
+
+  EXRImage exr;
+  InitEXRImage(&exr);
+  exr.num_channels = names.size();
+  exr.channel_names = names.data();
+  exr.images = images.data();
+  exr.pixel_types = types.data();
+  exr.requested_pixel_types = types.data();
+  exr.width = w;
+  exr.height = h;
+
+  const char* err;
+  if (SaveMultiChannelEXRToFile(&exr, filename.c_str(), &err) != 0)
+    fprintf(stderr, "[PathTracer] Error saving %s: %s\n", filename.c_str(), err);
+}
+
+void PathTracer::save_snapshot() {
+  if (outputFilename == "") return;
+
+  // write to temporary files and rename them, so that a job killed while
+  // writing still leaves the previous snapshot
+  string hdrFilename = outputFilename.substr(0, outputFilename.find_last_of('.')) + ".exr";
+  write_png(outputFilename + ".tmp", frameBuffer);
+  std::rename((outputFilename + ".tmp").c_str(), outputFilename.c_str());
+  save_hdr_image(hdrFilename + ".tmp");
+  std::rename((hdrFilename + ".tmp").c_str(), hdrFilename.c_str());
+
+  if (!render_silent)
+    fprintf(stdout, "\r[PathTracer] Saved snapshot of pass %zu to %s.\n",
+            passIndex, outputFilename.c_str());
+}
+
+void PathTracer::denoise() {
+  Timer denoiseTimer;
+  denoiseTimer.start();
+
+  size_t n = sampleBuffer.w * sampleBuffer.h;
+  vector<Spectrum> albedo(n);
+  vector<Vector3D> normal(n);
+  vector<double> depth(n), variance(n);
+  for (size_t i = 0; i < n; i++) {
+    int count = sampleCountBuffer[i];
+    if (!count) continue;
+    albedo[i] = albedoSumBuffer[i] * (1.f / count);
+    normal[i] = normalSumBuffer[i] / count;
+    depth[i] = depthSumBuffer[i] / count;
+    // variance of the pixel's mean; a single sample is taken to be as
+    // uncertain as it is bright
+    double mu = illumSumBuffer[i] / count;
+    variance[i] = count > 1 ?
+      max(0., (illumSqSumBuffer[i] - illumSumBuffer[i] * mu) / (count - 1)) / count :
+      mu * mu;
+  }
+  denoiser->denoise(&sampleBuffer, albedo, normal, depth, variance);
+  sampleBuffer.toColor(frameBuffer, 0, 0, sampleBuffer.w, sampleBuffer.h);
+
+  denoiseTimer.stop();
+  if (!render_silent)  fprintf(stdout, "[PathTracer] Denoised in %.4fs.\n", denoiseTimer.duration());
+}
+
 void PathTracer::save_sampling_rate_image(string filename) {
   size_t w = frameBuffer.w;
   size_t h = frameBuffer.h;
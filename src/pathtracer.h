@@ -17,6 +17,13 @@
 #include "image.h"
 #include "work_queue.h"
 #include "intersection.h"
+#include "radiance_cache.h"
+#include "guiding_field.h"
+#include "primary_hit_cache.h"
+#include "denoiser.h"
+#include "medium.h"
+#include "interface_medium.h"
+#include "integrator.h"
 
 // #include "lenscamera.h"
 
@@ -38,13 +45,14 @@ struct WorkItem {
   // Default constructor.
   WorkItem() : WorkItem(0, 0, 0, 0) { }
 
-  WorkItem(int x, int y, int w, int h)
-      : tile_x(x), tile_y(y), tile_w(w), tile_h(h) {}
+  WorkItem(int x, int y, int w, int h, int samples = 0)
+      : tile_x(x), tile_y(y), tile_w(w), tile_h(h), num_samples(samples) {}
 
   int tile_x;
   int tile_y;
   int tile_w;
   int tile_h;
+  int num_samples;  ///< samples to add to each unconverged pixel this pass
 
 };
 
@@ -77,7 +85,26 @@ class PathTracer {
              bool direct_hemisphere_sample = false,
              string filename = "",
              double lensRadius = 0.25,
-             double focalDistance = 4.7);
+             double focalDistance = 4.7,
+             string envmap_path = "",
+             bool envmap_debug = false,
+             string sample_generator = "sobol",
+             size_t seed = 0,
+             double max_render_time = 0.,
+             bool progressive = false,
+             double snapshot_interval = 0.,
+             bool adjoint_rr = false,
+             bool guiding = false,
+             string integrator = "volpath",
+             size_t primary_hit_pattern = 0,
+             bool denoise = false,
+             string aovs = "",
+             bool irradiance_cache = false,
+             string medium = "",
+             bool medium_bricks = false,
+             bool ratio_tracking = false,
+             string homogeneous_medium = "",
+             size_t noise_cache = 16);
 
   /**
    * Destructor.
@@ -159,10 +186,18 @@ class PathTracer {
    */
   void save_sampling_rate_image(std::string filename);
 
+  /**
+   * Save the unclamped radiance estimates to an OpenEXR file, with a
+   * layer for each of the AOVs.
+   */
+  void save_hdr_image(std::string filename);
+
   Vector2D cell_tl, cell_br;
   bool render_cell;
 
  private:
+  template <DirectLightingStrategy kStrategy> friend class VolumetricPathIntegrator;
+  friend Integrator* create_integrator(const std::string& name, PathTracer* pathtracer);
 
   /**
    * Used in initialization.
@@ -186,34 +221,124 @@ class PathTracer {
    */
   Spectrum estimate_reduced_radiance(const Spectrum &src_radiance, const Vector3D &src, const Vector3D &recv);
 
+  /**
+   * Estimate the radiance reaching recv from a light dist away along wi,
+   * which may be infinite for a distant light.
+   */
+  Spectrum estimate_light_radiance(const Spectrum &src_radiance, const Vector3D &recv,
+                                   const Vector3D &wi, double dist);
+
   Spectrum estimate_direct_lighting_hemisphere(const Ray &r, const StaticScene::Intersection& isect, const StaticScene::Interaction& interact);
+  /**
+   * Light sampling. With kDeltaLightsOnly, every light of the scene must be
+   * a delta light, and the area light loop is compiled out.
+   */
+  template <bool kDeltaLightsOnly>
   Spectrum estimate_direct_lighting_importance(const Ray &r, const StaticScene::Intersection& isect, const StaticScene::Interaction& interact);
 
-  Spectrum est_radiance_global_illumination(Ray &r); 
+  /**
+   * The volumetric path tracer, compiled for one way of estimating direct
+   * lighting so that the choice is not revisited at every vertex.
+   */
+  template <DirectLightingStrategy kStrategy>
+  Spectrum est_radiance_global_illumination(Ray &r, const PrimaryHit* primary = NULL,
+                                            RadianceComponents* components = NULL); 
   Spectrum zero_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect, const StaticScene::Interaction& interact);
+  template <DirectLightingStrategy kStrategy>
   Spectrum one_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect, const StaticScene::Interaction& interact);
-  Spectrum at_least_one_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect, const StaticScene::Interaction& interact);
+  template <DirectLightingStrategy kStrategy>
+  Spectrum at_least_one_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect, const StaticScene::Interaction& interact, double throughput, Spectrum* direct = NULL);
+
+  /**
+   * Decide how many times to continue a path from vertex p, given its
+   * throughput from the camera. Returns 0 to terminate the path, and sets
+   * weight to the factor that keeps each continuation unbiased.
+   */
+  size_t sample_continuations(const Vector3D& p, double throughput, double* weight);
 
   Spectrum normal_shading(const Vector3D& n) {
     return Spectrum(n[0],n[1],n[2])*.5 + Spectrum(.5,.5,.5);
   }
 
   /**
-   * Trace a camera ray given by the pixel coordinate.
+   * Find the first hit of camera ray r.
+   */
+  PrimaryHit trace_primary(Ray& r);
+
+  /**
+   * Add the albedo, normal and depth of the first surface camera ray r
+   * hits to the pixel's feature sums. primary is the hit if it is known.
    */
-  Spectrum raytrace_pixel(size_t x, size_t y, bool useThinLens);
+  void record_features(size_t index, Ray r, const PrimaryHit* primary);
+
+  /**
+   * Trace num_samples more camera rays through the pixel, add them to its
+   * running statistics and return the pixel's new estimate. Without
+   * kJitter, every ray goes through the center of the pixel. With
+   * kReuseHits, the rays go through the positions of primaryHits and
+   * reuse their first hits.
+   */
+  template <bool kJitter, bool kReuseHits>
+  Spectrum raytrace_pixel(size_t x, size_t y, size_t num_samples);
 
   /**
    * Raytrace a tile of the scene and update the frame buffer. Is run
-   * in a worker thread.
+   * in a worker thread. Every pixel of the tile that is not converged yet
+   * gets up to num_samples more samples.
    */
-  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h,
+                     int num_samples);
 
   /**
    * Implementation of a ray tracer worker thread
    */
   void worker_thread();
 
+  /**
+   * Relative error of a pixel's estimate: the half width of its 95%
+   * confidence interval over its mean.
+   */
+  double pixel_error(size_t index) const;
+
+  /**
+   * True if the pixel needs no more samples, either because its error is
+   * within maxTolerance or because it reached ns_aa samples.
+   */
+  bool pixel_converged(size_t index) const;
+
+  /**
+   * Hand out the sample budget of the next pass to the tiles with the
+   * highest estimated error and put them on the work queue. Returns false
+   * when the image met its error target, ran out of time or has no pixels
+   * left to sample.
+   */
+  bool schedule_pass();
+
+  /**
+   * Block until all workers finished the current pass, then let the last
+   * one schedule the next. Returns false when rendering is over.
+   */
+  bool wait_for_next_pass();
+
+  /**
+   * Write the image rendered so far over the output file and its .exr
+   * sibling, so that an interrupted job still leaves its latest result.
+   */
+  void save_snapshot();
+
+  /**
+   * Denoise the finished render in sampleBuffer and frameBuffer, guided
+   * by the pixels' features and variance.
+   */
+  void denoise();
+
+  /**
+   * True if the AOV called name is written.
+   */
+  bool has_aov(const string& name) const {
+    return std::find(aovs.begin(), aovs.end(), name) != aovs.end();
+  }
+
   /**
    * Log a ray miss.
    */
@@ -250,6 +375,16 @@ class PathTracer {
   size_t samplesPerBatch;
   float maxTolerance;
   bool direct_hemisphere_sample; ///< true if sampling uniformly from hemisphere for direct lighting. Otherwise, light sample
+  string sampleGeneratorName;    ///< sample generator each worker thread draws from
+  size_t seed;                   ///< frame seed all random numbers derive from
+  double maxRenderTime;          ///< time limit of a render in seconds, 0 if none
+  bool progressive;              ///< render whole-image passes of doubling sample count
+  double snapshotInterval;       ///< seconds between snapshots, 0 if none
+  bool adjointRR;                ///< drive roulette and splitting by radianceCache
+  bool guiding;                  ///< sample directions from guidingField
+  string integratorName;         ///< integrator that traces the camera rays
+  vector<string> aovs;           ///< AOVs written to the .exr next to the image
+  bool recordFeatures;           ///< record first-hit features, for the denoiser or AOVs
 
   // Integration state //
 
@@ -263,6 +398,13 @@ class PathTracer {
   EnvironmentLight *envLight;    ///< environment map
   Sampler2D* gridSampler;        ///< samples unit grid
   Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
+  RadianceCache* radianceCache;  ///< reflected radiance learned by earlier passes
+  GuidingField* guidingField;    ///< incident radiance learned by earlier passes
+  PrimaryHitCache* primaryHits;  ///< first hits of camera rays, NULL if not reused
+  IrradianceCache* irradianceCache; ///< indirect irradiance of the path integrator, NULL if off
+  Integrator* integrator;        ///< estimates the radiance of camera rays
+  Denoiser* denoiser;            ///< filters finished renders, NULL if off
+  Spectrum (PathTracer::*pixelKernel)(size_t, size_t, size_t); ///< raytrace_pixel for this render
   HDRImageBuffer sampleBuffer;   ///< sample buffer
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
@@ -271,12 +413,34 @@ class PathTracer {
   size_t ns_dist;
   Phase* phase;
   Sampler3D* sphereSampler;
-  Spectrum pos2phase(const Vector3D& pos);
-  static double pos2extinction(const Vector3D& pos);
-  static double pos2scattering(const Vector3D& pos);
-  double space_step;
+  Medium* medium;                ///< participating medium filling the scene
+  bool mediumGiven;              ///< whether medium was given, else it is the objects' media or the cloud
+  size_t noiseCache;             ///< bytes the cloud's bricks of noise may take
+  bool residualTracking;         ///< whether transmittance is tracked above a control extinction
 
   std::vector<int> sampleCountBuffer;   ///< sample count buffer
+  std::vector<Spectrum> radianceSumBuffer; ///< sum of each pixel's samples
+  std::vector<double> illumSumBuffer;      ///< sum of the samples' illuminance
+  std::vector<double> illumSqSumBuffer;    ///< sum of its squares
+  std::vector<Spectrum> albedoSumBuffer;   ///< sum of the first-hit albedos
+  std::vector<Vector3D> normalSumBuffer;   ///< sum of the first-hit normals
+  std::vector<double> depthSumBuffer;      ///< sum of the first-hit distances
+  std::vector<RadianceComponents> componentSumBuffer; ///< sum of the samples' components, empty unless AOVs need them
+
+  // Sample scheduling //
+
+  std::vector<WorkItem> passTiles;          ///< tiles covering the render area
+  size_t passIndex;                         ///< passes scheduled so far
+  Timer renderTimer;                        ///< time since rendering started
+  std::condition_variable cv_pass;
+  std::mutex m_pass;
+  size_t passArrived;                       ///< workers done with the pass
+  size_t passGeneration;                    ///< bumped when a pass starts
+  bool passesDone;                          ///< no pass left to render
+  double passStartTime;                     ///< render time the last pass started at
+  size_t passStartSamples;                  ///< samples taken before the last pass
+  double lastSnapshotTime;                  ///< render time of the last snapshot
+  std::string outputFilename;               ///< file render_to_file writes to
 
   // Internals //
 
@@ -1,6 +1,8 @@
 #include "phase.h"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <utility>
 
@@ -10,14 +12,30 @@ using std::swap;
 
 namespace CGL {
 
-Spectrum IsotropicPhase::f(const Vector3D& wo, const Vector3D& wi) {
+namespace {
+
+// Turns v, given in a frame whose z axis is w, into the frame w is in, by
+// the orthonormal basis of Duff et al. 2017, which is the identity for
+// w = (0, 0, 1).
+Vector3D about(const Vector3D& w, const Vector3D& v) {
+  double sign = w.z >= 0. ? 1. : -1.;
+  double a = -1. / (sign + w.z);
+  double b = w.x * w.y * a;
+  Vector3D x(1. + sign * w.x * w.x * a, sign * b, -sign * w.x);
+  Vector3D y(b, sign + w.y * w.y * a, -w.y);
+  return v.x * x + v.y * y + v.z * w;
+}
+
+} // namespace
+
+Spectrum IsotropicPhase::f(const Vector3D& wo, const Vector3D& wi) const {
   // This function takes in both wo and wi and returns the evaluation of
   // the BSDF for those two directions.
   double pdf = 1. / (4. * PI);
   return Spectrum(pdf, pdf, pdf);
 }
 
-Spectrum IsotropicPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+Spectrum IsotropicPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const {
   // This function takes in only wo and provides pointers for wi and pdf,
   // which should be assigned by this function.
   // After sampling a value for wi, it returns the evaluation of the BSDF
@@ -26,7 +44,7 @@ Spectrum IsotropicPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf)
   return f(wo, *wi);
 }
 
-Spectrum HenyeyGreensteinPhase::f(const Vector3D& wo, const Vector3D& wi) {
+Spectrum HenyeyGreensteinPhase::f(const Vector3D& wo, const Vector3D& wi) const {
   // This function takes in both wo and wi and returns the evaluation of
   // the BSDF for those two directions.
   double costheta = dot(wo, -wi) / (wo.norm() * wi.norm());
@@ -38,16 +56,20 @@ Spectrum HenyeyGreensteinPhase::f(const Vector3D& wo, const Vector3D& wi) {
   return Spectrum(p_hg, p_hg, p_hg);
 }
 
-Spectrum HenyeyGreensteinPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+Spectrum HenyeyGreensteinPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const {
   // This function takes in only wo and provides pointers for wi and pdf,
   // which should be assigned by this function.
   // After sampling a value for wi, it returns the evaluation of the BSDF
   // at (wo, *wi).
-  *wi = sampler.get_sample(pdf);
+  *wi = about(wo.unit(), sampler.get_sample(pdf));
   return f(wo, *wi);
 }
 
-Spectrum SchlickPhase::f(const Vector3D& wo, const Vector3D& wi) {
+float HenyeyGreensteinPhase::pdf(const Vector3D& wo, const Vector3D& wi) const {
+  return HenyeyGreensteinSampler3D::pdf(g, dot(wo, wi) / (wo.norm() * wi.norm()));
+}
+
+Spectrum SchlickPhase::f(const Vector3D& wo, const Vector3D& wi) const {
   // This function takes in both wo and wi and returns the evaluation of
   // the BSDF for those two directions.
   double costheta = dot(wo, -wi) / (wo.norm() * wi.norm());
@@ -61,15 +83,109 @@ Spectrum SchlickPhase::f(const Vector3D& wo, const Vector3D& wi) {
   return rtr;
 }
 
-Spectrum SchlickPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+Spectrum SchlickPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const {
   // This function takes in only wo and provides pointers for wi and pdf,
   // which should be assigned by this function.
   // After sampling a value for wi, it returns the evaluation of the BSDF
   // at (wo, *wi).
-  *wi = sampler.get_sample(pdf);
+  *wi = about(wo.unit(), sampler.get_sample(pdf));
   return f(wo, *wi);
 }
 
+float SchlickPhase::pdf(const Vector3D& wo, const Vector3D& wi) const {
+  // the sampler follows the blue channel of k, about wo
+  return SchlickSampler3D::pdf(k.b, dot(wo, wi) / (wo.norm() * wi.norm()));
+}
+
+TabulatedPhase::TabulatedPhase(const std::vector<double>& theta,
+                               const std::vector<Spectrum>& rows)
+  : values(kBins), pdfs(kBins), cdf(kBins + 1, 0.), guide(kBins) {
+  // sample the rows at the middle of each bin, and normalize each channel
+  // over the bins' solid angles
+  std::vector<double> solid_angle(kBins);
+  Spectrum total;
+  for (size_t i = 0; i < kBins; i++) {
+    double t = (i + .5) * 180. / kBins;
+    size_t j = std::upper_bound(theta.begin(), theta.end(), t) - theta.begin();
+    if (j == 0) {
+      values[i] = rows.front();
+    } else if (j == theta.size()) {
+      values[i] = rows.back();
+    } else {
+      double s = (t - theta[j - 1]) / (theta[j] - theta[j - 1]);
+      values[i] = rows[j - 1] * (1. - s) + rows[j] * s;
+    }
+    solid_angle[i] = 2. * PI * (cos(i * PI / kBins) - cos((i + 1) * PI / kBins));
+    total += values[i] * solid_angle[i];
+  }
+  for (size_t i = 0; i < kBins; i++) {
+    values[i] /= total;
+    pdfs[i] = (values[i].r + values[i].g + values[i].b) / 3.;
+    cdf[i + 1] = cdf[i] + pdfs[i] * solid_angle[i];
+  }
+  for (size_t i = 1; i < kBins; i++) cdf[i] /= cdf[kBins];
+  cdf[kBins] = 1.;
+
+  size_t i = 0;
+  for (size_t j = 0; j < kBins; j++) {
+    while (i < kBins - 1 && cdf[i + 1] <= double(j) / kBins) i++;
+    guide[j] = i;
+  }
+}
+
+TabulatedPhase* TabulatedPhase::load(const std::string& filename) {
+  std::ifstream in(filename.c_str());
+  if (!in) return NULL;
+  std::vector<double> theta;
+  std::vector<Spectrum> rows;
+  Spectrum total;
+  std::string line;
+  while (getline(in, line)) {
+    std::istringstream fields(line);
+    double t, v[4];
+    if (!(fields >> t)) continue;
+    size_t n = 0;
+    while (n < 4 && fields >> v[n]) n++;
+    if (n != 1 && n != 3) return NULL;
+    Spectrum row = n == 1 ? Spectrum(v[0], v[0], v[0]) : Spectrum(v[0], v[1], v[2]);
+    if (t < 0. || t > 180. || (!theta.empty() && t <= theta.back()) ||
+        row.r < 0. || row.g < 0. || row.b < 0.)
+      return NULL;
+    theta.push_back(t);
+    rows.push_back(row);
+    total += row;
+  }
+  if (theta.size() < 2 || total.r <= 0. || total.g <= 0. || total.b <= 0.)
+    return NULL;
+  return new TabulatedPhase(theta, rows);
+}
+
+Spectrum TabulatedPhase::f(const Vector3D& wo, const Vector3D& wi) const {
+  return values[bin(dot(wo, -wi) / (wo.norm() * wi.norm()))];
+}
+
+Spectrum TabulatedPhase::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const {
+  // find the bin by the guide table, then the angle within it, uniformly
+  // in solid angle
+  double u = sample_1d();
+  size_t i = guide[min(size_t(u * kBins), kBins - 1)];
+  while (i < kBins - 1 && cdf[i + 1] <= u) i++;
+  double c0 = cos(i * PI / kBins), c1 = cos((i + 1) * PI / kBins);
+  double cos_theta = c0 + (c1 - c0) * (u - cdf[i]) / (cdf[i + 1] - cdf[i]);
+
+  // z is the cosine to wo, the opposite of the scattering angle's
+  double z = -cos_theta;
+  double sinTheta = sqrt(max(0., 1. - z * z));
+  double phi = 2. * PI * sample_1d();
+  *wi = about(wo.unit(), Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z));
+  *pdf = pdfs[i];
+  return values[i];
+}
+
+float TabulatedPhase::pdf(const Vector3D& wo, const Vector3D& wi) const {
+  return pdfs[bin(dot(wo, -wi) / (wo.norm() * wi.norm()))];
+}
+
 void Phase::reflect(const Vector3D& wo, Vector3D* wi) {
 
   // TODO: 1.1
@@ -10,6 +10,9 @@
 #include "image.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
 
 namespace CGL {
 
@@ -19,6 +22,8 @@ namespace CGL {
 class Phase {
  public:
 
+  virtual ~Phase() { }
+
   /**
    * Evaluate Phase.
    * Given incident light direction wi and outgoing light direction wo. Note
@@ -28,7 +33,7 @@ class Phase {
    * \param wi incident light direction in local space of point of intersection
    * \return reflectance in the given incident/outgoing directions
    */
-  virtual Spectrum f (const Vector3D& wo, const Vector3D& wi) = 0;
+  virtual Spectrum f (const Vector3D& wo, const Vector3D& wi) const = 0;
 
   /**
    * Evaluate Phase.
@@ -41,7 +46,16 @@ class Phase {
    * \param pdf address to store the pdf of the output incident direction
    * \return reflectance in the output incident and given outgoing directions
    */
-  virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf) = 0;
+  virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf) const = 0;
+
+  /**
+   * Get the pdf with which sample_f returns wi given wo, with respect to
+   * solid angle.
+   * \param wo outgoing light direction in local space of point of intersection
+   * \param wi incident light direction in local space of point of intersection
+   * \return pdf of sampling wi
+   */
+  virtual float pdf (const Vector3D& wo, const Vector3D& wi) const = 0;
 
   /**
    * Get the emission value of the particle material. For non-emitting particle
@@ -82,8 +96,9 @@ class IsotropicPhase : public Phase {
 
   IsotropicPhase() { }
 
-  Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum f(const Vector3D& wo, const Vector3D& wi) const;
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const;
+  float pdf(const Vector3D& wo, const Vector3D& wi) const { return 1. / (4. * PI); }
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
 
@@ -101,8 +116,9 @@ class HenyeyGreensteinPhase : public Phase {
   HenyeyGreensteinPhase() : g(0.2) { }
   HenyeyGreensteinPhase(const double &g) : g(g) { }
 
-  Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum f(const Vector3D& wo, const Vector3D& wi) const;
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const;
+  float pdf(const Vector3D& wo, const Vector3D& wi) const;
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
 
@@ -130,8 +146,9 @@ class SchlickPhase : public Phase {
   SchlickPhase(const Spectrum &k) : k(k) { }
   ~SchlickPhase() { }
 
-  Spectrum f(const Vector3D& wo, const Vector3D& wi);
-  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+  Spectrum f(const Vector3D& wo, const Vector3D& wi) const;
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const;
+  float pdf(const Vector3D& wo, const Vector3D& wi) const;
   Spectrum get_emission() const { return Spectrum(); }
   bool is_delta() const { return false; }
 
@@ -145,6 +162,57 @@ private:
 
 }; // class SchlickPhase
 
+/**
+ * A phase function tabulated over the scattering angle, such as a Mie
+ * lobe. It is binned in 1024 equal steps of the angle, constant within
+ * each, and sampled by inverting the cdf of the bins' mean over the color
+ * channels through a guide table, so that pdf is that mean of f exactly.
+ */
+class TabulatedPhase : public Phase {
+ public:
+
+  /**
+   * Load a table from a text file of lines "theta value" or "theta r g b",
+   * theta the scattering angle in degrees from 0 (forward) to 180, in
+   * increasing order. The values are interpolated linearly in theta and
+   * normalized over the sphere; lines starting with # are comments.
+   * Returns NULL if the file cannot be read, has fewer than two rows or
+   * sums to zero.
+   */
+  static TabulatedPhase* load(const std::string& filename);
+
+  Spectrum f(const Vector3D& wo, const Vector3D& wi) const;
+  Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) const;
+  float pdf(const Vector3D& wo, const Vector3D& wi) const;
+  Spectrum get_emission() const { return Spectrum(); }
+  bool is_delta() const { return false; }
+
+private:
+  static const size_t kBins = 1024;
+
+  /**
+   * Constructor.
+   * \param theta scattering angles of the rows, in degrees, increasing
+   * \param values the phase function at each
+   */
+  TabulatedPhase(const std::vector<double>& theta,
+                 const std::vector<Spectrum>& values);
+
+  /**
+   * Get the bin of the cosine of the scattering angle.
+   */
+  size_t bin(double cos_theta) const {
+    return std::min(size_t(acos(std::min(std::max(cos_theta, -1.), 1.)) *
+                           (kBins / PI)), kBins - 1);
+  }
+
+  std::vector<Spectrum> values;  ///< normalized phase function in each bin
+  std::vector<float> pdfs;       ///< mean of each bin's channels
+  std::vector<double> cdf;       ///< of the bins over the sphere, kBins + 1 entries
+  std::vector<uint16_t> guide;   ///< first bin reaching each of kBins steps of the cdf
+
+}; // class TabulatedPhase
+
 
 }
 
@@ -0,0 +1,55 @@
+#include "primary_hit_cache.h"
+
+#include "random_util.h"
+
+namespace CGL {
+
+PrimaryHitCache::PrimaryHitCache(size_t pattern_size)
+  : n(pattern_size > 0 ? pattern_size : 1), computed(false),
+    v_fov(0), aspect_ratio(0), near_clip(0), far_clip(0), w(0), h(0), seed(0) { }
+
+void PrimaryHitCache::validate(const Camera& camera, size_t w, size_t h,
+                               size_t seed) {
+  if (computed && camera.position() == position &&
+      camera.view_point() == view_point && camera.up_dir() == up &&
+      camera.v_fov() == v_fov && camera.aspect_ratio() == aspect_ratio &&
+      camera.near_clip() == near_clip && camera.far_clip() == far_clip &&
+      w == this->w && h == this->h && seed == this->seed)
+    return;
+
+  position = camera.position();
+  view_point = camera.view_point();
+  up = camera.up_dir();
+  v_fov = camera.v_fov();
+  aspect_ratio = camera.aspect_ratio();
+  near_clip = camera.near_clip();
+  far_clip = camera.far_clip();
+  this->w = w;
+  this->h = h;
+  this->seed = seed;
+  computed = true;
+
+  entries.assign(w * h * n * n, Entry());
+}
+
+void PrimaryHitCache::invalidate() {
+  computed = false;
+  std::vector<Entry>().swap(entries);
+}
+
+Vector2D PrimaryHitCache::offset(size_t x, size_t y, size_t i) const {
+  uint64_t key = hash_uint64(seed ^ hash_uint64((uint64_t(y) << 32 | x) * (n * n) + i));
+  double u = (key >> 11) / 9007199254740992.;
+  double v = (hash_uint64(key) >> 11) / 9007199254740992.;
+  return Vector2D((i % n + u) / n, (i / n + v) / n);
+}
+
+const PrimaryHit* PrimaryHitCache::store(size_t index, size_t i,
+                                         const PrimaryHit& hit) {
+  Entry& e = entries[index * n * n + i];
+  e.hit = hit;
+  e.valid = true;
+  return &e.hit;
+}
+
+} // namespace CGL
@@ -0,0 +1,97 @@
+#ifndef CGL_PRIMARYHITCACHE_H
+#define CGL_PRIMARYHITCACHE_H
+
+#include <vector>
+
+#include "CGL/vector2D.h"
+#include "intersection.h"
+#include "camera.h"
+
+namespace CGL {
+
+/**
+ * What a camera ray sees first: its nearest intersection, if it has one.
+ * Only the deterministic hit is kept. The transmittance of the media in
+ * front of it is a random estimate, so it is drawn again by every sample
+ * rather than reused.
+ */
+struct PrimaryHit {
+
+  PrimaryHit() : hit(false) { }
+
+  bool hit;                         ///< whether the ray hits anything
+  StaticScene::Intersection isect;  ///< nearest intersection, if hit
+};
+
+/**
+ * Caches the PrimaryHit of the camera rays through a fixed stratified
+ * pattern of n x n positions in every pixel. Samples that return to a
+ * position skip tracing its camera ray. The hits last across passes and
+ * renders until the camera, the frame or the scene changes.
+ */
+class PrimaryHitCache {
+ public:
+
+  /**
+   * Constructor.
+   * \param pattern_size number of positions along each side of a pixel
+   */
+  PrimaryHitCache(size_t pattern_size);
+
+  /**
+   * Number of positions in each pixel.
+   */
+  size_t num_positions() const { return n * n; }
+
+  /**
+   * Drop the hits unless they were computed for the current state of
+   * camera, a w x h frame and seed.
+   */
+  void validate(const Camera& camera, size_t w, size_t h, size_t seed);
+
+  /**
+   * Drop the hits, for example because the scene changed.
+   */
+  void invalidate();
+
+  /**
+   * Get the offset in [0, 1)^2 of position i of pixel (x, y) from the
+   * pixel's bottom left corner. Each position has its own stratum, and is
+   * jittered within it by a hash of the pixel, i and the seed.
+   */
+  Vector2D offset(size_t x, size_t y, size_t i) const;
+
+  /**
+   * Get the hit of position i of pixel index, or NULL if it has not been
+   * stored yet. Each pixel must be used by one thread at a time.
+   */
+  const PrimaryHit* lookup(size_t index, size_t i) const {
+    const Entry& e = entries[index * n * n + i];
+    return e.valid ? &e.hit : NULL;
+  }
+
+  /**
+   * Store the hit of position i of pixel index and return the stored copy.
+   */
+  const PrimaryHit* store(size_t index, size_t i, const PrimaryHit& hit);
+
+ private:
+  struct Entry {
+    Entry() : valid(false) { }
+    PrimaryHit hit;
+    bool valid;
+  };
+
+  size_t n;
+  std::vector<Entry> entries;
+
+  // what the hits were computed for
+  bool computed;
+  Vector3D position, view_point, up;
+  double v_fov, aspect_ratio, near_clip, far_clip;
+  size_t w, h, seed;
+};
+
+} // namespace CGL
+
+#endif // CGL_PRIMARYHITCACHE_H
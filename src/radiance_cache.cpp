@@ -0,0 +1,74 @@
+#include "radiance_cache.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "random_util.h"
+
+namespace CGL {
+
+namespace {
+
+// Records are summed as integers in units of 2^-16, after clamping, so
+// that the sums do not depend on the order they were added in.
+const double kFixedPointScale = 65536.;
+const double kMaxRecord = 1e6;
+
+// Number of records a cell needs before lookups trust it.
+const uint32_t kMinRecords = 8;
+
+} // namespace
+
+RadianceCache::RadianceCache(size_t log2_size) {
+  mask = (size_t(1) << log2_size) - 1;
+  cells = new Cell[mask + 1];
+  reset(BBox(Vector3D(0, 0, 0), Vector3D(1, 1, 1)));
+}
+
+RadianceCache::~RadianceCache() {
+  delete[] cells;
+}
+
+void RadianceCache::reset(const BBox& bounds, size_t resolution) {
+  double extent = std::max(bounds.extent.x, std::max(bounds.extent.y, bounds.extent.z));
+  origin = bounds.min;
+  inv_cell_size = extent > 0 ? resolution / extent : 1.;
+  for (size_t i = 0; i <= mask; i++) {
+    cells[i].sum = 0;
+    cells[i].count = 0;
+    cells[i].estimate = -1.f;
+  }
+}
+
+size_t RadianceCache::cell_index(const Vector3D& p) const {
+  Vector3D q = (p - origin) * inv_cell_size;
+  uint64_t x = uint64_t(int64_t(floor(q.x))) & 0x1fffff;
+  uint64_t y = uint64_t(int64_t(floor(q.y))) & 0x1fffff;
+  uint64_t z = uint64_t(int64_t(floor(q.z))) & 0x1fffff;
+  return hash_uint64(x | y << 21 | z << 42) & mask;
+}
+
+void RadianceCache::record(const Vector3D& p, double radiance) {
+  Cell& cell = cells[cell_index(p)];
+  radiance = std::min(std::max(radiance, 0.), kMaxRecord);
+  cell.sum.fetch_add(uint64_t(radiance * kFixedPointScale), std::memory_order_relaxed);
+  cell.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RadianceCache::update() {
+  for (size_t i = 0; i <= mask; i++) {
+    uint32_t count = cells[i].count.load(std::memory_order_relaxed);
+    if (count < kMinRecords) continue;
+    uint64_t sum = cells[i].sum.load(std::memory_order_relaxed);
+    cells[i].estimate = float(sum / kFixedPointScale / count);
+  }
+}
+
+bool RadianceCache::lookup(const Vector3D& p, double* radiance) const {
+  float estimate = cells[cell_index(p)].estimate;
+  if (estimate < 0) return false;
+  *radiance = estimate;
+  return true;
+}
+
+} // namespace CGL
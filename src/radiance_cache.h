@@ -0,0 +1,70 @@
+#ifndef CGL_RADIANCECACHE_H
+#define CGL_RADIANCECACHE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "CGL/vector3D.h"
+#include "bbox.h"
+
+namespace CGL {
+
+/**
+ * A coarse world-space cache of scalar radiance, stored in a hash grid.
+ * Paths record estimates at their vertices while a pass renders; between
+ * passes, update() folds the records into the estimates that lookup()
+ * returns. Lookups therefore never see the pass being rendered, and since
+ * records are summed in fixed point, the estimates do not depend on the
+ * order the threads recorded in.
+ */
+class RadianceCache {
+ public:
+
+  /**
+   * Constructor.
+   * \param log2_size log2 of the number of hash table entries
+   */
+  RadianceCache(size_t log2_size = 18);
+
+  ~RadianceCache();
+
+  /**
+   * Forget everything and cover bounds with cells of about
+   * 1 / resolution of its largest extent.
+   */
+  void reset(const BBox& bounds, size_t resolution = 64);
+
+  /**
+   * Add a radiance estimate at p. Safe to call from several threads.
+   */
+  void record(const Vector3D& p, double radiance);
+
+  /**
+   * Make the records so far visible to lookup(). Not thread safe.
+   */
+  void update();
+
+  /**
+   * Get the cached radiance around p. Returns false if the cell around p
+   * does not have enough records yet.
+   */
+  bool lookup(const Vector3D& p, double* radiance) const;
+
+ private:
+  struct Cell {
+    std::atomic<uint64_t> sum;    ///< sum of the records in fixed point
+    std::atomic<uint32_t> count;  ///< number of records
+    float estimate;               ///< mean as of the last update, < 0 if unknown
+  };
+
+  size_t cell_index(const Vector3D& p) const;
+
+  Cell* cells;
+  size_t mask;           ///< number of cells - 1
+  Vector3D origin;       ///< corner of the grid
+  double inv_cell_size;  ///< cells per unit length
+};
+
+} // namespace CGL
+
+#endif // CGL_RADIANCECACHE_H
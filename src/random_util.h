@@ -2,14 +2,108 @@
 #define CGL_RANDOMUTIL_H
 
 #include <cstdlib>
+#include <cstdint>
+#include <atomic>
 
 namespace CGL {
 
 /**
- * Returns a number distributed uniformly over [0, 1].
+ * The PCG32 random number generator (O'Neill 2014): 64 bits of state, a
+ * selectable stream and 32 bit outputs.
+ */
+class PCG32 {
+ public:
+
+  PCG32(uint64_t initstate = 0x853c49e6748fea9bULL,
+        uint64_t initseq = 0xda3e39cb94b95bdbULL) {
+    seed(initstate, initseq);
+  }
+
+  /**
+   * Restart at position initstate of stream initseq.
+   */
+  void seed(uint64_t initstate, uint64_t initseq) {
+    state = 0;
+    inc = (initseq << 1) | 1;
+    next_uint();
+    state += initstate;
+    next_uint();
+  }
+
+  /**
+   * Returns the next 32 random bits.
+   */
+  uint32_t next_uint() {
+    uint64_t oldstate = state;
+    state = oldstate * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = uint32_t(((oldstate >> 18) ^ oldstate) >> 27);
+    uint32_t rot = uint32_t(oldstate >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  /**
+   * Returns a number distributed uniformly over [0, 1).
+   */
+  double next_double() {
+    return next_uint() * (1. / 4294967296.);
+  }
+
+ private:
+  uint64_t state;  ///< position in the stream
+  uint64_t inc;    ///< stream selector, always odd
+
+}; // class PCG32
+
+/**
+ * The generator of the calling thread. Threads start on distinct streams;
+ * render workers reseed it per pixel sample with seed_random.
+ */
+inline PCG32& thread_rng() {
+  static std::atomic<uint64_t> next_stream(0);
+  static thread_local PCG32 rng(0x853c49e6748fea9bULL, next_stream++);
+  return rng;
+}
+
+/**
+ * Hashes x to a well mixed 32 bit value (the lowbias32 integer hash).
+ */
+inline uint32_t hash_uint32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+/**
+ * Hashes x to a well mixed 64 bit value (the splitmix64 finalizer).
+ */
+inline uint64_t hash_uint64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * Restart the calling thread's generator on the stream of one pixel sample,
+ * so the sample's random numbers do not depend on what the thread rendered
+ * before. The stream is a hash of the pixel, the sample index and the frame
+ * seed; the i-th number drawn from it is the sample's i-th dimension.
+ */
+inline void seed_random(uint64_t pixel, uint64_t sample, uint64_t seed = 0) {
+  uint64_t key = hash_uint64(seed ^ hash_uint64(pixel));
+  thread_rng().seed(hash_uint64(key ^ sample), key);
+}
+
+/**
+ * Returns a number distributed uniformly over [0, 1).
  */
 inline double random_uniform() {
-  return ((double)std::rand()) / RAND_MAX;
+  return thread_rng().next_double();
 }
 
 /**
@@ -0,0 +1,246 @@
+#include "sample_generator.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace CGL {
+
+thread_local SampleGenerator* current_sample_generator = NULL;
+
+namespace {
+
+// Maps 32 random bits to [0, 1).
+inline double to_unit(uint32_t x) {
+  return x * (1. / 4294967296.);
+}
+
+inline double fract(double x) {
+  return x - floor(x);
+}
+
+uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// Kensler's hash-based permutation of [0, l) and random float, from
+// "Correlated Multi-Jittered Sampling".
+uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+  uint32_t w = l - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= p;             i *= 0xe170893d;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8;        i *= 0x0929eb3f;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+                        i *= 0x6935fa69;
+    i ^= (i & w) >> 11; i *= 0x74dcb303;
+    i ^= (i & w) >> 2;  i *= 0x9e501cc3;
+    i ^= (i & w) >> 2;  i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+  return (i + p) % l;
+}
+
+double randfloat(uint32_t i, uint32_t p) {
+  i ^= p;
+  i ^= i >> 17;
+  i ^= i >> 10;  i *= 0xb36534e5;
+  i ^= i >> 12;
+  i ^= i >> 21;  i *= 0x93fc4795;
+  i ^= 0xdf6e307f;
+  i ^= i >> 17;  i *= 1 | p >> 18;
+  return to_unit(i);
+}
+
+// Owen scrambling in base 2 by hashing, from Burley's "Practical Hash-based
+// Owen Scrambling".
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The second Sobol' dimension; the first one is reverse_bits(index).
+uint32_t sobol_dimension_1(uint32_t index) {
+  uint32_t result = 0, v = 1u << 31;
+  for (; index; index >>= 1, v ^= v >> 1)
+    if (index & 1) result ^= v;
+  return result;
+}
+
+const uint32_t kPrimes[] = {
+    2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,
+    43,  47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101,
+    103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167,
+    173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239,
+    241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+const uint32_t kNumPrimes = sizeof(kPrimes) / sizeof(kPrimes[0]);
+
+// Generators of the R1 and R2 sequences: 1 / phi_d^k for the generalized
+// golden ratios phi_1 = 1.618... and phi_2 = 1.3247...
+const double kR1 = 0.6180339887498949;
+const double kR2x = 0.7548776662466927, kR2y = 0.5698402909980532;
+
+} // namespace
+
+// Sample Generator //
+
+void SampleGenerator::start_pixel_sample(size_t x, size_t y, size_t index) {
+  pixel_x = x;
+  pixel_y = y;
+  pixel_seed = hash_uint32(uint32_t(x) ^ hash_uint32(uint32_t(y) ^ frame_seed));
+  sample_index = index;
+  dimension = 0;
+}
+
+// Independent Sample Generator //
+
+double IndependentSampleGenerator::get_1d() {
+  dimension++;
+  return random_uniform();
+}
+
+Vector2D IndependentSampleGenerator::get_2d() {
+  dimension++;
+  return Vector2D(random_uniform(), random_uniform());
+}
+
+// Stratified Sample Generator //
+
+StratifiedSampleGenerator::StratifiedSampleGenerator(size_t samples_per_pixel,
+                                                     uint32_t seed)
+  : SampleGenerator(seed), num_samples(std::max<size_t>(samples_per_pixel, 1)) {
+  m = std::max<uint32_t>(uint32_t(sqrt(double(num_samples))), 1);
+  n = (num_samples + m - 1) / m;
+}
+
+double StratifiedSampleGenerator::get_1d() {
+  uint32_t p = next_dimension_seed();
+  // past the expected count, continue with fresh patterns
+  uint32_t s = sample_index % num_samples;
+  p ^= hash_uint32(sample_index / num_samples);
+
+  uint32_t stratum = permute(s, num_samples, p * 0x68bc21eb);
+  return (stratum + randfloat(s, p * 0x967a889b)) / num_samples;
+}
+
+Vector2D StratifiedSampleGenerator::get_2d() {
+  uint32_t p = next_dimension_seed();
+  uint32_t s = sample_index % num_samples;
+  p ^= hash_uint32(sample_index / num_samples);
+
+  s = permute(s, num_samples, p * 0x51633e2d);
+  uint32_t sx = permute(s % m, m, p * 0x68bc21eb);
+  uint32_t sy = permute(s / m, n, p * 0x02e5be93);
+  double jx = randfloat(s, p * 0x967a889b);
+  double jy = randfloat(s, p * 0x368cc8b7);
+  return Vector2D((s % m + (sy + jx) / n) / m,
+                  (s / m + (sx + jy) / m) / n);
+}
+
+// Halton Sample Generator //
+
+void HaltonSampleGenerator::start_pixel_sample(size_t x, size_t y,
+                                               size_t index) {
+  SampleGenerator::start_pixel_sample(x, y, index);
+  prime_index = 0;
+}
+
+double HaltonSampleGenerator::scrambled_radical_inverse(uint32_t seed) {
+  uint32_t base = kPrimes[prime_index++ % kNumPrimes];
+  double inv_base = 1. / base, inv_base_n = inv_base, result = 0.;
+  uint32_t index = sample_index;
+  // randomly permute the digits of each position, including the leading
+  // zeros; a plain shift would keep the first samples of the large bases
+  // bunched together
+  for (uint32_t digit_pos = 0; inv_base_n > 1e-10; ++digit_pos) {
+    uint32_t digit = index % base;
+    result += permute(digit, base, hash_uint32(seed ^ hash_uint32(digit_pos)))
+              * inv_base_n;
+    index /= base;
+    inv_base_n *= inv_base;
+  }
+  return std::min(result, 1. - 1e-10);
+}
+
+double HaltonSampleGenerator::get_1d() {
+  return scrambled_radical_inverse(next_dimension_seed());
+}
+
+Vector2D HaltonSampleGenerator::get_2d() {
+  uint32_t seed = next_dimension_seed();
+  double x = scrambled_radical_inverse(seed);
+  double y = scrambled_radical_inverse(hash_uint32(seed));
+  return Vector2D(x, y);
+}
+
+// Sobol Sample Generator //
+
+double SobolSampleGenerator::get_1d() {
+  uint32_t seed = next_dimension_seed();
+  uint32_t index = nested_uniform_scramble(sample_index, seed);
+  return to_unit(nested_uniform_scramble(reverse_bits(index),
+                                         hash_uint32(seed ^ 0x1u)));
+}
+
+Vector2D SobolSampleGenerator::get_2d() {
+  uint32_t seed = next_dimension_seed();
+  uint32_t index = nested_uniform_scramble(sample_index, seed);
+  uint32_t x = nested_uniform_scramble(reverse_bits(index),
+                                       hash_uint32(seed ^ 0x1u));
+  uint32_t y = nested_uniform_scramble(sobol_dimension_1(index),
+                                       hash_uint32(seed ^ 0x2u));
+  return Vector2D(to_unit(x), to_unit(y));
+}
+
+// Lattice Sample Generator //
+
+double LatticeSampleGenerator::get_1d() {
+  // the shift only depends on the dimension and the pixel's dither value,
+  // so a dimension keeps the dither pattern across the image
+  double shift = to_unit(hash_uint32(frame_seed ^ dimension++));
+  double dither = fract(kR2x * pixel_x + kR2y * pixel_y);
+  return fract(shift + dither + kR1 * sample_index);
+}
+
+Vector2D LatticeSampleGenerator::get_2d() {
+  uint32_t seed = hash_uint32(frame_seed ^ dimension++);
+  double dither_x = fract(kR2x * pixel_x + kR2y * pixel_y);
+  double dither_y = fract(kR2x * pixel_y + kR2y * pixel_x);
+  return Vector2D(fract(to_unit(seed) + dither_x + kR2x * sample_index),
+                  fract(to_unit(hash_uint32(seed)) + dither_y +
+                        kR2y * sample_index));
+}
+
+SampleGenerator* create_sample_generator(const std::string& name,
+                                         size_t samples_per_pixel,
+                                         uint32_t seed) {
+  if (name == "independent") return new IndependentSampleGenerator(seed);
+  if (name == "stratified")
+    return new StratifiedSampleGenerator(samples_per_pixel, seed);
+  if (name == "halton") return new HaltonSampleGenerator(seed);
+  if (name == "sobol") return new SobolSampleGenerator(seed);
+  if (name == "lattice") return new LatticeSampleGenerator(seed);
+  return NULL;
+}
+
+} // namespace CGL
@@ -0,0 +1,180 @@
+#ifndef CGL_SAMPLEGENERATOR_H
+#define CGL_SAMPLEGENERATOR_H
+
+#include <string>
+#include <cstdint>
+
+#include "CGL/vector2D.h"
+#include "random_util.h"
+
+namespace CGL {
+
+/**
+ * Interface for per-pixel sample generators.
+ * A generator hands out the dimensions of one pixel sample in order: each
+ * call to get_1d or get_2d consumes the next dimension, and
+ * start_pixel_sample rewinds to the first dimension of another sample.
+ * Samples of a pixel are well stratified within each dimension, while
+ * dimensions and pixels are decorrelated from each other by hashing. A
+ * sample only depends on its pixel, its index and the frame seed.
+ */
+class SampleGenerator {
+ public:
+
+  /**
+   * Constructor.
+   * \param seed frame seed; different seeds give independent renders
+   */
+  SampleGenerator(uint32_t seed = 0) : frame_seed(hash_uint32(seed)) { }
+
+  /**
+   * Virtual destructor.
+   */
+  virtual ~SampleGenerator() { }
+
+  /**
+   * Start sample number index of pixel (x, y) at its first dimension.
+   */
+  virtual void start_pixel_sample(size_t x, size_t y, size_t index);
+
+  /**
+   * Take the next dimension as a number in [0, 1).
+   */
+  virtual double get_1d() = 0;
+
+  /**
+   * Take the next dimension as a point of the unit square.
+   */
+  virtual Vector2D get_2d() = 0;
+
+ protected:
+  uint32_t frame_seed;        ///< hash of the frame seed
+  uint32_t pixel_x, pixel_y;  ///< current pixel
+  uint32_t pixel_seed;        ///< hash of the current pixel
+  uint32_t sample_index;      ///< index of the current sample in its pixel
+  uint32_t dimension;         ///< next dimension to hand out
+
+  /**
+   * Consume a dimension and return a seed unique to it and the pixel.
+   */
+  uint32_t next_dimension_seed() {
+    return hash_uint32(pixel_seed ^ hash_uint32(dimension++));
+  }
+
+}; // class SampleGenerator
+
+/**
+ * Independent uniform random numbers, i.e. plain Monte Carlo.
+ */
+class IndependentSampleGenerator : public SampleGenerator {
+ public:
+
+  IndependentSampleGenerator(uint32_t seed = 0) : SampleGenerator(seed) { }
+
+  double get_1d();
+  Vector2D get_2d();
+
+}; // class IndependentSampleGenerator
+
+/**
+ * Correlated multi-jittered samples (Kensler 2013). Needs the number of
+ * samples per pixel up front; every dimension is an independently shuffled
+ * pattern of that many samples.
+ */
+class StratifiedSampleGenerator : public SampleGenerator {
+ public:
+
+  StratifiedSampleGenerator(size_t samples_per_pixel, uint32_t seed = 0);
+
+  double get_1d();
+  Vector2D get_2d();
+
+ private:
+  uint32_t num_samples;  ///< samples per pixel
+  uint32_t m, n;         ///< the 2D pattern is an m x n grid of cells
+
+}; // class StratifiedSampleGenerator
+
+/**
+ * The Halton sequence with per-pixel random digit permutations. Each
+ * dimension takes the next prime base, wrapping around past the prime table.
+ */
+class HaltonSampleGenerator : public SampleGenerator {
+ public:
+
+  HaltonSampleGenerator(uint32_t seed = 0) : SampleGenerator(seed) { }
+
+  void start_pixel_sample(size_t x, size_t y, size_t index);
+  double get_1d();
+  Vector2D get_2d();
+
+ private:
+  uint32_t prime_index;  ///< next prime base to use
+  double scrambled_radical_inverse(uint32_t seed);
+
+}; // class HaltonSampleGenerator
+
+/**
+ * Padded Sobol' samples with hash-based Owen scrambling (Burley 2020).
+ * Each dimension uses the first two Sobol' dimensions with its own
+ * nested uniform scramble and its own shuffle of the sample index.
+ */
+class SobolSampleGenerator : public SampleGenerator {
+ public:
+
+  SobolSampleGenerator(uint32_t seed = 0) : SampleGenerator(seed) { }
+
+  double get_1d();
+  Vector2D get_2d();
+
+}; // class SobolSampleGenerator
+
+/**
+ * A rank-1 lattice (the R2 sequence) shifted per pixel. The shifts follow
+ * the R2 dither over pixel coordinates, which spreads the error of
+ * neighbouring pixels apart like a blue-noise mask would.
+ */
+class LatticeSampleGenerator : public SampleGenerator {
+ public:
+
+  LatticeSampleGenerator(uint32_t seed = 0) : SampleGenerator(seed) { }
+
+  double get_1d();
+  Vector2D get_2d();
+
+}; // class LatticeSampleGenerator
+
+/**
+ * Create the generator called name ("independent", "stratified", "halton",
+ * "sobol" or "lattice") for the given number of samples per pixel and frame
+ * seed. Returns NULL if the name is unknown.
+ */
+SampleGenerator* create_sample_generator(const std::string& name,
+                                         size_t samples_per_pixel,
+                                         uint32_t seed = 0);
+
+/**
+ * The generator the samplers of the calling thread draw from. When NULL,
+ * they fall back to random_uniform().
+ */
+extern thread_local SampleGenerator* current_sample_generator;
+
+/**
+ * Returns the next dimension of the current sample in [0, 1).
+ */
+inline double sample_1d() {
+  return current_sample_generator ? current_sample_generator->get_1d()
+                                  : random_uniform();
+}
+
+/**
+ * Returns the next dimension of the current sample in the unit square.
+ */
+inline Vector2D sample_2d() {
+  return current_sample_generator ? current_sample_generator->get_2d()
+                                  : Vector2D(random_uniform(), random_uniform());
+}
+
+} // namespace CGL
+
+#endif // CGL_SAMPLEGENERATOR_H
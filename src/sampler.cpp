@@ -1,4 +1,6 @@
 #include "sampler.h"
+
+#include "macrocell_grid.h"
  
 namespace CGL {
 
@@ -6,7 +8,7 @@ namespace CGL {
 
 Vector2D UniformGridSampler2D::get_sample() const {
 
-  return Vector2D(random_uniform(), random_uniform());
+  return sample_2d();
 
 }
 
@@ -14,8 +16,9 @@ Vector2D UniformGridSampler2D::get_sample() const {
 
 Vector3D UniformHemisphereSampler3D::get_sample() const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  Vector2D Xi = sample_2d();
+  double Xi1 = Xi.x;
+  double Xi2 = Xi.y;
 
   double theta = acos(Xi1);
   double phi = 2.0 * PI * Xi2;
@@ -31,19 +34,21 @@ Vector3D UniformHemisphereSampler3D::get_sample() const {
 // Uniform Sphere Sampler3D Implementation //
 
 Vector3D UniformSphereSampler3D::get_sample() const {
-    double z = random_uniform() * 2 - 1;
+    Vector2D Xi = sample_2d();
+    double z = Xi.x * 2 - 1;
     double sinTheta = sqrt(std::max(0.0, 1.0f - z * z));
 
-    double phi = 2.0f * PI * random_uniform();
+    double phi = 2.0f * PI * Xi.y;
 
     return Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z);
 }
 
 Vector3D UniformSphereSampler3D::get_sample(float *pdf) const {
-    double z = random_uniform() * 2 - 1;
+    Vector2D Xi = sample_2d();
+    double z = Xi.x * 2 - 1;
     double sinTheta = sqrt(std::max(0.0, 1.0f - z * z));
 
-    double phi = 2.0f * PI * random_uniform();
+    double phi = 2.0f * PI * Xi.y;
     *pdf = 1. / (4. * PI);
     return Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z);
 }
@@ -55,8 +60,9 @@ Vector3D CosineWeightedHemisphereSampler3D::get_sample() const {
 
 Vector3D CosineWeightedHemisphereSampler3D::get_sample(float *pdf) const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  Vector2D Xi = sample_2d();
+  double Xi1 = Xi.x;
+  double Xi2 = Xi.y;
 
   double r = sqrt(Xi1);
   double theta = 2. * PI * Xi2;
@@ -71,24 +77,34 @@ Vector3D HenyeyGreensteinSampler3D::get_sample() const {
 }
 
 Vector3D HenyeyGreensteinSampler3D::get_sample(float *pdf) const {
-  // Sampling of z changed according to HenyeyGreenstein phase function
-  // THIS SAMPLER IS WRONG
+  // z is the cosine to wo, the opposite of the scattering angle's, with
+  // density (1 - g^2) / (2 (1 + g^2 + 2 g z)^1.5); its cdf inverts in
+  // closed form, which is ill-conditioned for g near 0, where it is
+  // uniform
   double g2 = g * g;
-  double u, z;
-
-  do {
-    u = random_uniform();
-    z = (1. + g2) / (2. * g) - 
-    ((1. - g2) * (1. - g2)) / (32. * PI * PI * g2 * g * u * u);
-  } while(z > 1. or z < -1.);
+  double u = sample_1d();
+  double z;
+  if (fabs(g) < 1e-3) {
+    z = 1. - 2. * u;
+  } else {
+    double s = (1. - g2) / (1. - g + 2. * g * u);
+    z = - (1. + g2 - s * s) / (2. * g);
+  }
+  z = std::min(std::max(z, -1.), 1.);
 
   double sinTheta = sqrt(std::max(0.0, 1.0f - z * z));
 
-  double phi = 2.0f * PI * random_uniform();
-  *pdf = (1. - g2) / (4. * PI * pow((1. + g2 - 2. * g * z), 1.5));
+  double phi = 2.0f * PI * sample_1d();
+  *pdf = HenyeyGreensteinSampler3D::pdf(g, z);
   return Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z);
 }
 
+double HenyeyGreensteinSampler3D::pdf(double g, double z) {
+  if (fabs(g) < 1e-3) return 1. / (4. * PI);
+  double g2 = g * g;
+  return (1. - g2) / (4. * PI * pow((1. + g2 + 2. * g * z), 1.5));
+}
+
 Vector3D SchlickSampler3D::get_sample() const {
   // TO CHANGE
   float f;
@@ -96,27 +112,30 @@ Vector3D SchlickSampler3D::get_sample() const {
 }
 
 Vector3D SchlickSampler3D::get_sample(float *pdf) const {
-  // Sampling of z changed according to HenyeyGreenstein phase function
-  double u, z;
-  // std::srand(int(time(0)));
-  int rand_num = std::rand() % 3;
-  // double k1 = rand_num == 0 ? k.r : (rand_num == 1 ? k.g : k.b); 
+  // z inverts the cdf of its density below in closed form, which maps
+  // [0, 1] onto [-1, 1] and is ill-conditioned for k near 0, where it is
+  // uniform
   double k1 = k.b; 
   double k2 = k1 * k1;
-
-  do {
-    u = random_uniform();
-    z = ((k2 - 1) / (2. * k1 * u - k1 + 1) + 1.) / k1;
-    // printf("%f", z);
-  } while(z > 1. or z < -1.);
+  double u = sample_1d();
+  double z = fabs(k1) < 1e-3 ? 2. * u - 1. :
+             ((k2 - 1) / (2. * k1 * u - k1 + 1) + 1.) / k1;
+  z = std::min(std::max(z, -1.), 1.);
 
   double sinTheta = sqrt(std::max(0.0, 1.0f - z * z));
 
-  double phi = 2.0f * PI * random_uniform();
-  *pdf = (1. - k2) / (2. * pow((1. - k1 * z), 2.));
+  double phi = 2.0f * PI * sample_1d();
+  *pdf = SchlickSampler3D::pdf(k1, z);
   return Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z);
 }
 
+double SchlickSampler3D::pdf(double k, double z) {
+  // z has density (1 - k^2) / (2 (1 - k z)^2) and phi is uniform over 2 pi;
+  // dropping the 2 pi, as this once did, gives the density of z alone
+  if (fabs(k) < 1e-3) return 1. / (4. * PI);
+  return (1. - k * k) / (4. * PI * pow((1. - k * z), 2.));
+}
+
 double DistanceSampler1D::get_sample() const {
   float f;
   return get_sample(&f);
@@ -132,39 +151,59 @@ double DistanceSampler1D::get_sample() const {
 // }
 
 double DistanceSampler1D::get_sample(float *pdf) const {
-  double u, extinction = 0., delta_dist, total_dist = 0.;
+  const Medium* collision_medium;
+  return get_sample(pdf, &collision_medium);
+}
+
+double DistanceSampler1D::get_sample(float *pdf, const Medium** collision_medium) const {
   *pdf = 1.;
-  float pre_pdf = 1.; double pre_extinction = 0.;
-  // printf("max_t: %f\n", max_t);
-  
-  while (true) {
-    u = random_uniform();
-    pre_extinction = extinction;
-    extinction = pos2extinction(ray -> o + ray -> d * total_dist);
-    delta_dist = - log(1. - u) / extinction;
-
-    // have reached the nearest surface
-    if (total_dist > max_t) {
-      // backtrack to last step
-      delta_dist = max_t - (total_dist - step);
-      total_dist = max_t + EPS_F;
-      *pdf = pre_pdf * exp(- pre_extinction * delta_dist);
-      break;
+  *collision_medium = NULL;
+  MajorantIterator segments(medium, *ray, max_t);
+  MajorantSegment s;
+  while (segments.next(&s)) {
+    double majorant = s.max_extinction;
+    if (majorant <= 0.) continue;
+    // free flights are memoryless, so each segment starts afresh
+    double total_dist = s.t0;
+    if (s.min_extinction == majorant) {
+      // every collision is real
+      total_dist -= log(1. - sample_1d()) / majorant;
+      if (total_dist >= s.t1) continue;
+      *collision_medium = s.medium;
+      return total_dist;
     }
-
-    if (delta_dist < step) {
-      pre_pdf = *pdf;
-      *pdf *= extinction * exp(- extinction * delta_dist);
-      total_dist += delta_dist;
-      break;    
+    while (true) {
+      total_dist -= log(1. - sample_1d()) / majorant;
+      if (total_dist >= s.t1) break;
+      // a real collision, rather than a null one
+      if (sample_1d() * majorant < s.medium -> extinction(ray -> o + ray -> d * total_dist)) {
+        *collision_medium = s.medium;
+        return total_dist;
+      }
     }
-    else {
-      pre_pdf = *pdf;
-      *pdf *= exp(- extinction * step);
-      total_dist += step;
+  }
+  return max_t;
+}
+
+double TransmittanceEstimator::estimate(const Ray& r, double max_t) const {
+  MajorantIterator segments(medium, r, max_t);
+  MajorantSegment s;
+  double transmittance = 1.;
+  while (segments.next(&s)) {
+    bool homogeneous = s.min_extinction == s.max_extinction;
+    double control = residual || homogeneous ? s.min_extinction : 0.;
+    double majorant = s.max_extinction - control;
+    if (control > 0.) transmittance *= exp(- control * (s.t1 - s.t0));
+    if (majorant <= 0.) continue;
+    double total_dist = s.t0;
+    while (true) {
+      total_dist -= log(1. - sample_1d()) / majorant;
+      if (total_dist >= s.t1) break;
+      double sigma = s.medium -> extinction(r.o + r.d * total_dist) - control;
+      transmittance *= 1. - sigma / majorant;
     }
   }
-  return total_dist;
+  return transmittance;
 }
 
 } // namespace CGL
@@ -7,6 +7,8 @@
 #include "CGL/vector3D.h"
 #include "CGL/misc.h"
 #include "random_util.h"
+#include "sample_generator.h"
+#include "medium.h"
 
 namespace CGL {
 
@@ -116,6 +118,12 @@ class HenyeyGreensteinSampler3D : public Sampler3D {
   HenyeyGreensteinSampler3D(double &g) : g(g) {}
   Vector3D get_sample() const;
   Vector3D get_sample(float* pdf) const;
+
+  /**
+   * Density per solid angle of a direction at cosine z to the axis, for
+   * asymmetry g, as sampled: uniform, 1 / (4 pi), where |g| < 1e-3.
+   */
+  static double pdf(double g, double z);
   
  private:
   double g;
@@ -127,25 +135,72 @@ class SchlickSampler3D : public Sampler3D {
   SchlickSampler3D(Spectrum &k) : k(k) {}
   Vector3D get_sample() const;
   Vector3D get_sample(float* pdf) const;
+
+  /**
+   * Density per solid angle of a direction at cosine z to the axis, for
+   * asymmetry k. This is (1 - k^2) / (4 pi (1 - k z)^2), which integrates
+   * to 1 over the sphere. It is uniform, 1 / (4 pi), where |k| < 1e-3, as
+   * the samples are there.
+   */
+  static double pdf(double k, double z);
   
  private:
   Spectrum k;
 }; 
 
+/**
+ * Samples the distance to the first collision along a ray through a
+ * medium by delta tracking: tentative collisions are drawn against the
+ * local majorant of each macrocell the ray crosses and accepted with
+ * probability extinction / majorant. Empty macrocells are skipped, and
+ * homogeneous ones sampled in closed form. The distances follow the exact
+ * free-flight distribution, so the pdf is reported as 1. Returns max_t if
+ * the ray reaches it without colliding.
+ */
 class DistanceSampler1D : public Sampler1D {
  public:
-  DistanceSampler1D(double (*pos2extinction)(const Vector3D&), double step)
-   : pos2extinction(pos2extinction), ray(NULL), step(step) { }
+  DistanceSampler1D(const Medium* medium)
+   : ray(NULL), max_t(INF_D), medium(medium) { }
   void set_ray(Ray* r) { ray = r; };
   void set_max_t(double t) { max_t = t; };
   double get_sample() const;
   double get_sample(float* pdf) const;
+
+  /**
+   * Sample a distance as get_sample, and get the medium the collision is
+   * in, NULL if there is none.
+   */
+  double get_sample(float* pdf, const Medium** collision_medium) const;
   
  private:
   Ray* ray;
-  double step;
   double max_t;
-  double (*pos2extinction)(const Vector3D&);
+  const Medium* medium;
+};
+
+/**
+ * Estimates the transmittance along a ray through a medium by ratio
+ * tracking: tentative collisions are drawn against the local majorant of
+ * each macrocell the ray crosses, and each scales the estimate by the
+ * chance it was a null collision. Residual ratio tracking integrates each
+ * macrocell's minorant as a control extinction in closed form and tracks
+ * only the residual above it. Both are unbiased, and look the extinction
+ * up about majorant times per unit length. Through homogeneous macrocells
+ * the transmittance is exact.
+ */
+class TransmittanceEstimator {
+ public:
+  TransmittanceEstimator(const Medium* medium, bool residual = true)
+   : medium(medium), residual(residual) { }
+
+  /**
+   * Estimate the transmittance along r from its origin to max_t.
+   */
+  double estimate(const Ray& r, double max_t) const;
+
+ private:
+  const Medium* medium;
+  bool residual;  ///< whether to track above a control extinction
 };
 
 // class DistanceSampler1D : public Sampler1D {
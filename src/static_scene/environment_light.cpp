@@ -3,12 +3,17 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/stat.h>
 
 namespace CGL { namespace StaticScene {
 
-EnvironmentLight::EnvironmentLight(const HDRImageBuffer* envMap)
+EnvironmentLight::EnvironmentLight(const HDRImageBuffer* envMap,
+                                   const std::string& path, bool save_debug)
     : envMap(envMap) {
-    	init();
+    	init(path, save_debug);
 }
 
 EnvironmentLight::~EnvironmentLight() {
@@ -18,7 +23,7 @@ EnvironmentLight::~EnvironmentLight() {
 }
 
 
-void EnvironmentLight::init() {
+void EnvironmentLight::init(const std::string& path, bool save_debug) {
 	uint32_t w = envMap->w, h = envMap->h;
   pdf_envmap = new double[w * h];
 	conds_y = new double[w * h];
@@ -26,49 +31,55 @@ void EnvironmentLight::init() {
 
 	std::cout << "[PathTracer] Initializing environment light...";
 
-  // 3.3 step 1
-	// Store the environment map pdf to pdf_envmap
-
-	double sum = 0;
-	for (int j = 0; j < h; ++j) {
-		for (int i = 0; i < w; ++i) {
-            pdf_envmap[w * j + i] = envMap->data[w * j + i].illum() * sin(PI * (j+.5) / h);
-            sum += pdf_envmap[w * j + i];
-		}
-  }
-
-  // normalize
-  for (int j = 0; j < h; ++j) {
-		for (int i = 0; i < w; ++i) {
-      pdf_envmap[w * j + i] /= sum;
+  std::string cache_path = path.empty() ? "" : path + ".cdf";
+  if (!cache_path.empty() && load_distribution(cache_path, path)) {
+    std::cout << "loaded " << cache_path << "...";
+  } else {
+    // 3.3 step 1
+    // Store the environment map pdf to pdf_envmap. Rows are independent, so
+    // they are filled in parallel; marginal_y temporarily holds row sums.
+    double sum = 0;
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for (int j = 0; j < (int)h; ++j) {
+      double sin_theta = sin(PI * (j+.5) / h);
+      double row_sum = 0;
+      for (int i = 0; i < (int)w; ++i) {
+        pdf_envmap[w * j + i] = envMap->data[w * j + i].illum() * sin_theta;
+        row_sum += pdf_envmap[w * j + i];
+      }
+      marginal_y[j] = row_sum;
+      sum += row_sum;
     }
-	}
 
-  // TODO: 3.3 step 2
-  // Store the marginal distribution for y to marginal_y. Make sure to normalize pdf_envmap.
-  double current_marginal_y_accumulation = 0.;
-  double real_marginal_y[h];
-  for (int j = 0; j < h; ++j) {
-		for (int i = 0; i < w; ++i) {
-      marginal_y[j] += pdf_envmap[w * j + i];
+    // 3.3 step 3
+    // Normalize pdf_envmap and store the conditional distribution for x given
+    // y to conds_y. A black row is never picked, but keep its CDF valid.
+    #pragma omp parallel for schedule(static)
+    for (int j = 0; j < (int)h; ++j) {
+      double row_sum = marginal_y[j];
+      double accumulation = 0.;
+      for (int i = 0; i < (int)w; ++i) {
+        accumulation += pdf_envmap[w * j + i];
+        conds_y[w * j + i] = row_sum > 0 ? accumulation / row_sum
+                                         : double(i + 1) / w;
+        pdf_envmap[w * j + i] /= sum;
+      }
+      conds_y[w * j + w - 1] = 1.;
     }
-    real_marginal_y[j] = marginal_y[j];
-    marginal_y[j] += current_marginal_y_accumulation;
-    current_marginal_y_accumulation = marginal_y[j];
-	}
 
-  // TODO: 3.3 step 3
-  // Store the conditional distribution for x given y to conds_y
-  for (int j = 0; j < h; ++j) {
-    double current_cond_y_accumulation = 0.;
-		for (int i = 0; i < w; ++i) {
-      conds_y[w * j + i] = 
-        pdf_envmap[w * j + i] / real_marginal_y[j] + current_cond_y_accumulation;
-      current_cond_y_accumulation = conds_y[w * j + i];
+    // 3.3 step 2
+    // Store the marginal distribution for y to marginal_y
+    double accumulation = 0.;
+    for (int j = 0; j < (int)h; ++j) {
+      accumulation += marginal_y[j] / sum;
+      marginal_y[j] = accumulation;
     }
-	}
+    marginal_y[h - 1] = 1.;
 
-	if (true) {
+    if (!cache_path.empty()) save_distribution(cache_path, path);
+  }
+
+	if (save_debug) {
     std::cout << "Saving out probability_debug image for debug." << std::endl;
     save_probability_debug();
   }
@@ -76,6 +87,70 @@ void EnvironmentLight::init() {
 	std::cout << "done." << std::endl;
 }
 
+// Distribution cache
+
+namespace {
+
+const char kCacheMagic[8] = {'C', 'G', 'L', 'E', 'N', 'V', '0', '1'};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t w, h;
+  int64_t mtime, size;  ///< of the environment map file
+};
+
+// Fill in the header identifying the current version of the map at path.
+bool make_cache_header(const std::string& path, uint32_t w, uint32_t h,
+                       CacheHeader* header) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
+  std::memcpy(header->magic, kCacheMagic, sizeof(kCacheMagic));
+  header->w = w;
+  header->h = h;
+  header->mtime = st.st_mtime;
+  header->size = st.st_size;
+  return true;
+}
+
+} // namespace
+
+bool EnvironmentLight::load_distribution(const std::string& cache_path,
+                                         const std::string& path) {
+  uint32_t w = envMap->w, h = envMap->h;
+  CacheHeader expected, header;
+  if (!make_cache_header(path, w, h, &expected)) return false;
+
+  std::ifstream in(cache_path, std::ios::binary);
+  if (!in.read((char*) &header, sizeof(header))) return false;
+  if (std::memcmp(header.magic, expected.magic, sizeof(kCacheMagic)) ||
+      header.w != w || header.h != h ||
+      header.mtime != expected.mtime || header.size != expected.size)
+    return false;
+
+  in.read((char*) pdf_envmap, sizeof(double) * w * h);
+  in.read((char*) marginal_y, sizeof(double) * h);
+  in.read((char*) conds_y, sizeof(double) * w * h);
+  return bool(in);
+}
+
+void EnvironmentLight::save_distribution(const std::string& cache_path,
+                                         const std::string& path) const {
+  uint32_t w = envMap->w, h = envMap->h;
+  CacheHeader header;
+  if (!make_cache_header(path, w, h, &header)) return;
+
+  std::ofstream out(cache_path, std::ios::binary);
+  out.write((const char*) &header, sizeof(header));
+  out.write((const char*) pdf_envmap, sizeof(double) * w * h);
+  out.write((const char*) marginal_y, sizeof(double) * h);
+  out.write((const char*) conds_y, sizeof(double) * w * h);
+  if (!out) {
+    std::cout << "could not write " << cache_path << "...";
+    out.close();
+    std::remove(cache_path.c_str());
+  }
+}
+
 // Helper functions
 
 void EnvironmentLight::save_probability_debug() {
@@ -170,31 +245,24 @@ Spectrum EnvironmentLight::sample_L(const Vector3D& p, Vector3D* wi,
   Vector2D uni_2d_sample = sampler_uniform2d.get_sample();
   double u = uni_2d_sample.x, v = uni_2d_sample.y;
 
-  // use inversion method (provided in some slide) 
-  //to get the x, y of sample point
-  int x, y;
-  
-  // std::cout << std::endl << "u: " << v << std::endl;
-  for (int j = 0; j < h; j++) {
-    // std::cout << marginal_y[j] << " ";
-    if (marginal_y[j] > u) {
-      y = j;
-      break;
-    }
-  }
+  // use inversion method (provided in some slide) to get the x, y of the 
+  // sample point: binary search the marginal CDF for the row, then that 
+  // row's conditional CDF for the column
+  int y = std::upper_bound(marginal_y, marginal_y + h, u) - marginal_y;
+  y = std::min(y, int(h) - 1);
+
+  const double* row = conds_y + w * y;
+  int x = std::upper_bound(row, row + w, v) - row;
+  x = std::min(x, int(w) - 1);
+
+  // reuse what is left of u and v to place the sample inside the pixel
+  double y_lo = y > 0 ? marginal_y[y - 1] : 0., y_hi = marginal_y[y];
+  double x_lo = x > 0 ? row[x - 1] : 0., x_hi = row[x];
+  double dy = y_hi > y_lo ? (u - y_lo) / (y_hi - y_lo) : .5;
+  double dx = x_hi > x_lo ? (v - x_lo) / (x_hi - x_lo) : .5;
 
-  // std::cout << std::endl << "v: " << v << std::endl;
-  int row_skip = y * w;
-  for (int i = 0; i < w; i++) {
-    // std::cout << conds_y[row_skip + i] << " ";
-    if (conds_y[row_skip + i] > v) {
-      x = i;
-      break;
-    }
-  }
-  
   // get the sampled direction in theta_phi representation
-  Vector2D theta_phi = xy_to_theta_phi(Vector2D(x, y));
+  Vector2D theta_phi = xy_to_theta_phi(Vector2D(x + dx, y + dy));
   double theta = theta_phi.x, phi = theta_phi.y;
   double sin_theta = sin(theta);
   
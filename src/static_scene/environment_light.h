@@ -7,6 +7,8 @@
 
 #include "CGL/lodepng.h"
 
+#include <string>
+
 namespace CGL { namespace StaticScene {
 
 // An environment light can be thought of as an infinitely big sphere centered
@@ -16,7 +18,16 @@ namespace CGL { namespace StaticScene {
 // model in the scene.
 class EnvironmentLight : public SceneLight {
  public:
-  EnvironmentLight(const HDRImageBuffer* envMap);
+  /**
+   * Builds the importance sampling distribution of the environment map.
+   * \param envMap the environment map
+   * \param path the file the map was loaded from. When given, the
+   *             distribution is cached in path + ".cdf" and reused as long
+   *             as the map keeps the same size and modification time.
+   * \param save_debug write the distribution to probability_debug.png
+   */
+  EnvironmentLight(const HDRImageBuffer* envMap, const std::string& path = "",
+                   bool save_debug = false);
   ~EnvironmentLight();
   /**
    * In addition to the work done by sample_dir, this function also has to
@@ -30,6 +41,8 @@ class EnvironmentLight : public SceneLight {
    *   formula.
    * - Don't take linear time to generate a single sample! You'll be calling
    *   this a LOT; it should be fast.
+   * Rows and columns are found by binary search over the marginal and
+   * conditional CDFs, so a sample costs O(log w + log h).
    */
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
                     float* pdf) const;
@@ -50,9 +63,12 @@ private:
  UniformGridSampler2D sampler_uniform2d;
  UniformSphereSampler3D sampler_uniform_sphere;
 
- void init();
+ void init(const std::string& path, bool save_debug);
  double* pdf_envmap, *marginal_y, *conds_y;
 
+ bool load_distribution(const std::string& cache_path, const std::string& path);
+ void save_distribution(const std::string& cache_path, const std::string& path) const;
+
  Vector2D dir_to_theta_phi(const Vector3D &dir) const;
  Vector3D theta_phi_to_dir(const Vector2D &theta_phi) const;
 
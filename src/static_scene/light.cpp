@@ -1,8 +1,10 @@
 #include "light.h"
 
 #include <iostream>
+#include <algorithm>
 
 #include "../sampler.h"
+#include "../bsdf.h"   // make_coord_space
 
 namespace CGL { namespace StaticScene {
 
@@ -107,27 +109,118 @@ Spectrum AreaLight::sample_L(const Vector3D& p, Vector3D* wi,
   return cosTheta < 0 ? radiance : Spectrum();
 };
 
-// Sphere Light //
+bool AreaLight::lies_in(const BBox& box) const {
+  double tolerance = .05 * (dim_x.norm() + dim_y.norm());
+  for (int a = 0; a < 3; a++)
+    if (position[a] < box.min[a] - tolerance ||
+        position[a] > box.max[a] + tolerance) return false;
+  return true;
+}
 
-SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere) {
+// Sphere Light //
 
-}
+SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere)
+  : sphere(sphere), radiance(rad) { }
 
 Spectrum SphereLight::sample_L(const Vector3D& p, Vector3D* wi, 
                                float* distToLight, float* pdf) const {
 
-  return Spectrum();
+  Vector2D sample = sampler.get_sample();
+  Vector3D to_center = sphere->o - p;
+  double dc2 = to_center.norm2();
+  double r2 = sphere->r * sphere->r;
+
+  if (dc2 <= r2) {
+    // p is inside the sphere, every point of the surface is visible
+    double z = 1. - 2. * sample.x;
+    double sin_theta = sqrt(std::max(0., 1. - z * z));
+    double phi = 2. * PI * sample.y;
+    Vector3D n(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
+    Vector3D d = sphere->o + sphere->r * n - p;
+    double dist = d.norm();
+    *wi = d / dist;
+    double cos_light = fabs(dot(n, *wi));
+    if (dist == 0. || cos_light == 0.) return Spectrum();
+    *distToLight = dist - EPS_F;
+    *pdf = dist * dist / (4. * PI * r2 * cos_light);
+    return radiance;
+  }
+
+  // sample the cone of directions subtended by the sphere
+  double dc = sqrt(dc2);
+  double sin2_max = r2 / dc2;
+  double cos_max = sqrt(std::max(0., 1. - sin2_max));
+  // 1 - cos_max loses all precision for small or distant spheres
+  double one_minus_cos_max = sin2_max < 1e-4 ? .5 * sin2_max : 1. - cos_max;
+
+  double cos_theta = 1. - sample.x * one_minus_cos_max;
+  double sin2_theta = std::max(0., 1. - cos_theta * cos_theta);
+  double sin_theta = sqrt(sin2_theta);
+  double phi = 2. * PI * sample.y;
+
+  Matrix3x3 o2w;
+  make_coord_space(o2w, to_center / dc);
+  *wi = o2w * Vector3D(cos(phi) * sin_theta, sin(phi) * sin_theta, cos_theta);
+
+  // distance to the near side of the sphere along wi
+  double dist = dc * cos_theta - sqrt(std::max(0., r2 - dc2 * sin2_theta));
+  *distToLight = dist - EPS_F;
+  *pdf = 1. / (2. * PI * one_minus_cos_max);
+  return radiance;
 }
 
 // Mesh Light
 
-MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh) {
-
+MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh)
+  : mesh(mesh), radiance(rad), triangles(mesh->get_indices()), area(0.) {
+
+  size_t num_triangles = triangles.size() / 3;
+  area_cdf.reserve(num_triangles);
+  for (size_t i = 0; i < num_triangles; ++i) {
+    const Vector3D& p0 = mesh->positions[triangles[3 * i]];
+    const Vector3D& p1 = mesh->positions[triangles[3 * i + 1]];
+    const Vector3D& p2 = mesh->positions[triangles[3 * i + 2]];
+    area += .5 * cross(p1 - p0, p2 - p0).norm();
+    area_cdf.push_back(area);
+  }
 }
 
 Spectrum MeshLight::sample_L(const Vector3D& p, Vector3D* wi, 
                              float* distToLight, float* pdf) const {
-  return Spectrum();
+
+  if (area <= 0.) return Spectrum();
+
+  // pick a triangle proportionally to its area
+  double u = sample_1d() * area;
+  size_t tri = std::upper_bound(area_cdf.begin(), area_cdf.end(), u) 
+               - area_cdf.begin();
+  tri = std::min(tri, area_cdf.size() - 1);
+
+  const Vector3D& p0 = mesh->positions[triangles[3 * tri]];
+  const Vector3D& p1 = mesh->positions[triangles[3 * tri + 1]];
+  const Vector3D& p2 = mesh->positions[triangles[3 * tri + 2]];
+
+  // uniform point on the triangle
+  Vector2D sample = sampler.get_sample();
+  double su = sqrt(sample.x);
+  double b1 = 1. - su, b2 = sample.y * su;
+  Vector3D q = p0 + b1 * (p1 - p0) + b2 * (p2 - p0);
+  Vector3D n = cross(p1 - p0, p2 - p0).unit();
+
+  Vector3D d = q - p;
+  double sqDist = d.norm2();
+  double dist = sqrt(sqDist);
+  if (dist == 0.) return Spectrum();
+  *wi = d / dist;
+
+  // emission is two-sided, like EmissionBSDF seen from the camera
+  double cos_light = fabs(dot(n, *wi));
+  if (cos_light == 0.) return Spectrum();
+
+  // stop shadow rays just short of the emitter's own surface
+  *distToLight = dist - EPS_F;
+  *pdf = sqDist / (area * cos_light);
+  return radiance;
 }
 
 } // namespace StaticScene
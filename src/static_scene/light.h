@@ -7,6 +7,8 @@
 #include "../sampler.h" // UniformHemisphereSampler3D, UniformGridSampler2D
 #include "../image.h"   // HDRImageBuffer
 
+#include <vector>
+
 #include "scene.h"  // SceneLight
 #include "object.h" // Mesh, SphereObject
 
@@ -94,6 +96,13 @@ class AreaLight : public SceneLight {
                     float* pdf) const;
   bool is_delta_light() const { return false; }
 
+  /**
+   * Check whether the center of the light lies in box, up to a twentieth of
+   * the light's size. Scenes that pair an area light with the emissive
+   * quad it stands in for place the two a hair apart.
+   */
+  bool lies_in(const BBox& box) const;
+
  private:
   Spectrum radiance;
   Vector3D position;
@@ -107,6 +116,11 @@ class AreaLight : public SceneLight {
 
 // Sphere Light //
 
+/**
+ * An emissive sphere. Points outside the sphere sample the cone of directions
+ * subtended by it uniformly in solid angle, so every sample lands on the
+ * visible cap. Points inside fall back to sampling the surface by area.
+ */
 class SphereLight : public SceneLight {
  public:
   SphereLight(const Spectrum& rad, const SphereObject* sphere);
@@ -117,12 +131,17 @@ class SphereLight : public SceneLight {
  private:
   const SphereObject* sphere;
   Spectrum radiance;
-  UniformHemisphereSampler3D sampler;
+  UniformGridSampler2D sampler;
 
 }; // class SphereLight
 
 // Mesh Light
 
+/**
+ * An emissive triangle mesh. Triangles are picked with probability
+ * proportional to their area by binary search over a prefix sum of the
+ * triangle areas, so the mesh surface is sampled uniformly by area.
+ */
 class MeshLight : public SceneLight {
  public:
   MeshLight(const Spectrum& rad, const Mesh* mesh);
@@ -133,6 +152,11 @@ class MeshLight : public SceneLight {
  private:
   const Mesh* mesh;
   Spectrum radiance;
+  UniformGridSampler2D sampler;
+
+  std::vector<size_t> triangles;  ///< vertex indices, three per triangle
+  std::vector<double> area_cdf;   ///< prefix sum of triangle areas
+  double area;                    ///< total surface area
 
 }; // class MeshLight
 
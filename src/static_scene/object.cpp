@@ -13,7 +13,7 @@ namespace CGL { namespace StaticScene {
 
 // Mesh object //
 
-Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
+Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf, const Medium* medium) {
 
   unordered_map<const Vertex *, int> vertexLabels;
   vector<const Vertex *> verts;
@@ -41,6 +41,7 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
   }
 
   this->bsdf = bsdf;
+  this->medium = medium;
 
 }
 
@@ -63,11 +64,13 @@ BSDF* Mesh::get_bsdf() const {
 
 // Sphere object //
 
-SphereObject::SphereObject(const Vector3D& o, double r, BSDF* bsdf) {
+SphereObject::SphereObject(const Vector3D& o, double r, BSDF* bsdf,
+                           const Medium* medium) {
 
   this->o = o;
   this->r = r;
   this->bsdf = bsdf;
+  this->medium = medium;
   
 }
 
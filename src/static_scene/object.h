@@ -17,8 +17,9 @@ class Mesh : public SceneObject {
    * Construct a static mesh for rendering from halfedge mesh used in editing.
    * Note that this converts the input halfedge mesh into a collection of
    * world-space triangle primitives.
+   * \param medium medium inside the mesh, if it is closed, NULL if none
    */
-  Mesh(const HalfedgeMesh& mesh, BSDF* bsdf);
+  Mesh(const HalfedgeMesh& mesh, BSDF* bsdf, const Medium* medium = NULL);
 
   /**
    * Get all the primitives (Triangle) in the mesh.
@@ -33,12 +34,25 @@ class Mesh : public SceneObject {
    */
   BSDF* get_bsdf() const;
 
+  /**
+   * Get the medium inside the mesh.
+   * \return medium inside the mesh, NULL if none
+   */
+  const Medium* get_medium() const { return medium; }
+
+  /**
+   * Get the vertex indices of the mesh triangles, three per triangle.
+   * \return triangle vertex indices into positions and normals
+   */
+  const vector<size_t>& get_indices() const { return indices; }
+
   Vector3D *positions;  ///< position array
   Vector3D *normals;    ///< normal array
 
  private:
 
   BSDF* bsdf; ///< BSDF of surface material
+  const Medium* medium; ///< medium inside the mesh
 
   vector<size_t> indices;  ///< triangles defined by indices
 
@@ -54,7 +68,8 @@ class SphereObject : public SceneObject {
   * Constructor.
   * Construct a static sphere for rendering from given parameters
   */
-  SphereObject(const Vector3D& o, double r, BSDF* bsdf);
+  SphereObject(const Vector3D& o, double r, BSDF* bsdf,
+               const Medium* medium = NULL);
 
   /**
   * Get all the primitives (Sphere) in the sphere object.
@@ -69,12 +84,19 @@ class SphereObject : public SceneObject {
    */
   BSDF* get_bsdf() const;
 
+  /**
+   * Get the medium inside the sphere.
+   * \return medium inside the sphere, NULL if none
+   */
+  const Medium* get_medium() const { return medium; }
+
   Vector3D o; ///< origin
   double r;   ///< radius
 
 private:
 
   BSDF* bsdf; ///< BSDF of the sphere objects' surface material
+  const Medium* medium; ///< medium inside the sphere
 
 }; // class SphereObject
 
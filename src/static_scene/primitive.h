@@ -14,6 +14,12 @@ namespace CGL { namespace StaticScene {
 class Primitive {
  public:
 
+  /**
+   * Destructor. Virtual, as aggregates such as BVHAccel are deleted
+   * through pointers that may be to a derived type.
+   */
+  virtual ~Primitive() { }
+
   /**
    * Get the world space bounding box of the primitive.
    * \return world space bounding box of the primitive
@@ -50,6 +56,19 @@ class Primitive {
    */
   virtual BSDF* get_bsdf() const = 0;
 
+  /**
+   * Get the medium inside the surface of the primitive, NULL if there is
+   * none. Like the BSDF, it is stored in the SceneObject.
+   */
+  virtual const Medium* get_medium() const { return NULL; }
+
+  /**
+   * Get the normal of the surface itself at an intersection with the
+   * primitive, on the side of the shading normal i.n, telling which side
+   * of the surface a ray is on.
+   */
+  virtual Vector3D geometric_normal(const Intersection& i) const { return i.n; }
+
   /**
    * Draw with OpenGL (for visualization)
    * \param c desired highlight color
@@ -26,6 +26,13 @@ class SceneObject {
    */
   virtual BSDF* get_bsdf() const = 0;
 
+  /**
+   * Get the medium filling the object, NULL if there is none. The surface
+   * of an object with a medium only bounds it, and does not scatter light.
+   * \return the medium inside the object
+   */
+  virtual const Medium* get_medium() const { return NULL; }
+
 };
 
 
@@ -54,26 +61,11 @@ struct Scene {
   //  primitives depend on them (e.g. Mesh Triangles).
   std::vector<SceneObject*> objects;
 
-  // for sake of consistency of the scene object Interface
+  // for sake of consistency of the scene object Interface. Emissive meshes
+  // and spheres show up here as MeshLight / SphereLight as well, see
+  // DynamicScene::Scene::get_static_scene().
   std::vector<SceneLight*> lights;
 
-  // TODO (sky) :
-  // Adding object with emission BSDFs as mesh lights and sphere lights so 
-  // that light sampling configurations also applies to mesh lights. 
-//  for (SceneObject *obj : objects) {
-//    if (obj->get_material().emit != Spectrum()) {
-//      
-//      // mesh light
-//      if (dynamic_cast<Mesh*>(obj)) {
-//        staticLights.push_back()
-//      }
-//      
-//      // sphere light
-//      if (dynamic_cast<Sphere*>(obj)) {
-//
-//      }
-//  }
-
 };
 
 } // namespace StaticScene
@@ -60,6 +60,11 @@ class Sphere : public Primitive {
    */
   BSDF* get_bsdf() const { return object->get_bsdf(); }
 
+  /**
+   * Get the medium inside the sphere object.
+   */
+  const Medium* get_medium() const { return object->get_medium(); }
+
   /**
    * Compute the normal at a point of intersection.
    * NOTE (sky): This is required for all scene objects but we only need it
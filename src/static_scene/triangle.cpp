@@ -92,6 +92,14 @@ bool Triangle::intersect(const Ray& r, Intersection *isect) const {
 
 }
 
+Vector3D Triangle::geometric_normal(const Intersection& i) const {
+
+  Vector3D p0(mesh->positions[v1]), p1(mesh->positions[v2]), p2(mesh->positions[v3]);
+  Vector3D n = cross(p1 - p0, p2 - p0);
+  return dot(n, i.n) < 0 ? -n : n;
+
+}
+
 void Triangle::draw(const Color& c, float alpha) const {
   glColor4f(c.r, c.g, c.b, alpha);
   glBegin(GL_TRIANGLES);
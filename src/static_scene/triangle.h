@@ -61,6 +61,17 @@ namespace CGL { namespace StaticScene {
    */
   BSDF* get_bsdf() const { return mesh->get_bsdf(); }
 
+  /**
+   * Get the medium inside the mesh the triangle belongs to.
+   */
+  const Medium* get_medium() const { return mesh->get_medium(); }
+
+  /**
+   * Get the normal of the triangle's plane, on the side of its
+   * interpolated normal.
+   */
+  Vector3D geometric_normal(const Intersection& i) const;
+
   /**
    * Draw with OpenGL (for visualizer)
    */
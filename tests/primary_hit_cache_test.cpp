@@ -0,0 +1,149 @@
+// Renders a scene filled with a varying medium with and without -R and
+// checks that reusing camera ray hits converges to the same image. A cache
+// that kept one estimate of the media in front of each hit would add an
+// error that more samples never average out.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "CGL/CGL.h"
+
+#define TINYEXR_IMPLEMENTATION
+#include "CGL/tinyexr.h"
+
+#include "application.h"
+
+using namespace CGL;
+
+namespace {
+
+const size_t kWidth = 32, kHeight = 24;
+const size_t kSamples = 256;
+
+// Copy the Cornell box scene, turning its back wall into an emitter so
+// that the camera sees emission through the medium.
+bool write_scene(const std::string& from, const std::string& to) {
+  std::ifstream in(from.c_str());
+  if (!in) return false;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  std::string scene = ss.str();
+  const std::string wall = "target=\"#backWall-material\"";
+  size_t at = scene.find(wall);
+  if (at == std::string::npos) return false;
+  scene.replace(at, wall.size(), "target=\"#light-material\"");
+  std::ofstream out(to.c_str());
+  out << scene;
+  return bool(out);
+}
+
+// Write a .vol grid of smoothly varying extinction over the Cornell box,
+// so that the transmittance to every hit has to be estimated.
+bool write_medium(const std::string& filename) {
+  const int32_t n = 16;
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f) return false;
+  const int32_t header[5] = {1, n, n, n, 1};
+  const float bounds[6] = {-1.f, -.1f, -1.f, 1.f, 1.6f, 1.f};
+  fwrite("VOL\3", 1, 4, f);
+  fwrite(header, sizeof(int32_t), 5, f);
+  fwrite(bounds, sizeof(float), 6, f);
+  for (int32_t k = 0; k < n; k++)
+    for (int32_t j = 0; j < n; j++)
+      for (int32_t i = 0; i < n; i++) {
+        float v = .4f + .35f * sinf(.8f * i) * sinf(.8f * j) * sinf(.8f * k);
+        fwrite(&v, sizeof(float), 1, f);
+      }
+  return fclose(f) == 0;
+}
+
+// Render the scene and read back the emission reaching the camera
+// directly, the one term that the transmittance to the first hit scales.
+bool render(const std::string& scene, const std::string& medium,
+            const std::string& out, size_t reuse, size_t seed,
+            std::vector<float>* emission) {
+  AppConfig config;
+  config.pathtracer_ns_aa = kSamples;
+  config.pathtracer_max_ray_depth = 1;
+  config.pathtracer_max_tolerance = 0.f;
+  config.pathtracer_num_threads = std::max(1u, std::thread::hardware_concurrency());
+  config.pathtracer_seed = seed;
+  config.pathtracer_primary_hit_pattern = reuse;
+  config.pathtracer_aovs = "emission";
+  config.pathtracer_medium = medium;
+
+  // the application is not torn down, as in main
+  Collada::SceneInfo* sceneInfo = new Collada::SceneInfo();
+  if (Collada::ColladaParser::load(scene.c_str(), sceneInfo) < 0) return false;
+  Application* app = new Application(config, false);
+  app->init();
+  app->load(sceneInfo);
+  app->resize(kWidth, kHeight);
+  app->render_to_file(out + ".png", -1, 0, 0, 0);
+
+  EXRImage exr;
+  InitEXRImage(&exr);
+  const char* err;
+  std::string filename = out + ".exr";
+  if (ParseMultiChannelEXRHeaderFromFile(&exr, filename.c_str(), &err) != 0 ||
+      LoadMultiChannelEXRFromFile(&exr, filename.c_str(), &err) != 0)
+    return false;
+  emission->clear();
+  for (int c = 0; c < exr.num_channels; c++) {
+    if (std::string(exr.channel_names[c]).compare(0, 9, "emission.")) continue;
+    const float* values = (const float*) exr.images[c];
+    emission->insert(emission->end(), values, values + exr.width * exr.height);
+  }
+  FreeEXRImage(&exr);
+  return emission->size() == 3 * kWidth * kHeight;
+}
+
+double mean(const std::vector<float>& a) {
+  double sum = 0.;
+  for (size_t i = 0; i < a.size(); i++) sum += a[i];
+  return sum / a.size();
+}
+
+double mse(const std::vector<float>& a, const std::vector<float>& b) {
+  double sum = 0.;
+  for (size_t i = 0; i < a.size(); i++) sum += (a[i] - b[i]) * (a[i] - b[i]);
+  return sum / a.size();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <scene.dae> <output prefix>\n", argv[0]);
+    return 2;
+  }
+  std::string scene = std::string(argv[2]) + ".dae";
+  std::string out = argv[2], medium = out + ".vol";
+  std::vector<float> ref, jittered, cached;
+  if (!write_scene(argv[1], scene) || !write_medium(medium) ||
+      !render(scene, medium, out + "_ref", 0, 0, &ref) ||
+      !render(scene, medium, out + "_jittered", 0, 1, &jittered) ||
+      !render(scene, medium, out + "_cached", 4, 2, &cached)) {
+    fprintf(stderr, "could not render %s\n", scene.c_str());
+    return 1;
+  }
+
+  // two uncached renders differ by their noise alone; the cached render
+  // may be somewhat noisier, but must not drift from the reference
+  double noise = mse(ref, jittered);
+  double error = mse(ref, cached);
+  double bias = mean(cached) / mean(ref) - 1.;
+  printf("noise %g cached error %g mean bias %+.4f\n", noise, error, bias);
+  if (error > 1.5 * noise || fabs(bias) > .005) {
+    fprintf(stderr, "cached render does not converge to the reference\n");
+    return 1;
+  }
+  return 0;
+}